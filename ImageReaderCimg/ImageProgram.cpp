@@ -7,169 +7,2874 @@
 #include <cmath>
 #include <vector>
 #include <string>
-#include <map>
-#include <set>
 #include <chrono>
 #include <thread>
 #include <future>
 #include <algorithm>
 #include <filesystem>
+#include <new>
+#include <cstddef>
+#include <cstdint>
+#include <bit>
+#include <array>
+#include <streambuf>
+#include <limits>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <type_traits>
+#include <span>
+#include <cstring>
+#include <queue>
+#include <ctime>
+#include <cstdio>
+#include <iomanip>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define IMAGEREADER_POSIX 1
+#endif
+
+#ifdef IMAGEREADER_POSIX
+#include <sys/resource.h>
+#endif
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#ifdef __linux__
+#include <sched.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <cerrno>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+#endif
 
 #define cimg_use_jpeg
 
 
-using namespace cimg_library;
-namespace fs = std::filesystem;
+using namespace cimg_library;
+namespace fs = std::filesystem;
+
+// Progress bar function
+void ShowProgressBar(const std::string& taskName, int progress, int total) {
+    int barWidth = 50; // Width of the progress bar
+    float percentage = static_cast<float>(progress) / total;
+    int pos = static_cast<int>(barWidth * percentage);
+
+    std::cout << "\r" << taskName << " [";
+    for (int i = 0; i < barWidth; ++i) {
+        if (i < pos) std::cout << "=";
+        else if (i == pos) std::cout << ">";
+        else std::cout << " ";
+    }
+    std::cout << "] " << int(percentage * 100.0) << "%";
+    std::cout.flush();
+    if (progress == total) std::cout << std::endl;
+}
+
+// Allocator handing out cache-line aligned blocks, so a whole image is one aligned allocation
+template <typename T, std::size_t Alignment = 64>
+struct AlignedAllocator {
+    using value_type = T;
+
+    template <typename U>
+    struct rebind { using other = AlignedAllocator<U, Alignment>; };
+
+    AlignedAllocator() = default;
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&) noexcept {}
+
+    T* allocate(std::size_t n) {
+        return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(Alignment)));
+    }
+    void deallocate(T* p, std::size_t) noexcept {
+        ::operator delete(p, std::align_val_t(Alignment));
+    }
+
+    template <typename U>
+    bool operator==(const AlignedAllocator<U, Alignment>&) const noexcept { return true; }
+};
+
+// Luminance sort keys (the IEEE bits of 0.299 R + 0.587 G + 0.114 B) for packed RGB.
+// Every vector kernel does the same float multiplies and adds, in the same order,
+// as Scalar, so all kernels produce identical keys. Compute() picks the widest
+// kernel the CPU supports on first use; IMAGEREADER_SIMD=scalar|sse2|avx2|avx512
+// forces one.
+namespace Luminance {
+
+using Kernel = void (*)(const unsigned char* rgb, size_t count, std::uint32_t* keys);
+
+inline void Scalar(const unsigned char* rgb, size_t count, std::uint32_t* keys) {
+    for (size_t i = 0; i < count; ++i, rgb += 3) {
+        float luminance = 0.299f * rgb[0] + 0.587f * rgb[1] + 0.114f * rgb[2];
+        keys[i] = std::bit_cast<std::uint32_t>(luminance);
+    }
+}
+
+// Vector kernels convert whole blocks of pixels and may read up to 4 bytes past
+// a block. Run() feeds them the blocks that can over-read safely, then copies
+// the remainder into a padded buffer so the tail goes through the same code.
+template <size_t BlockPixels>
+void Run(void (*blocks)(const unsigned char*, size_t, std::uint32_t*),
+         const unsigned char* rgb, size_t count, std::uint32_t* keys) {
+    constexpr size_t kBlockBytes = BlockPixels * 3;
+    size_t full = count * 3 >= 4 ? (count * 3 - 4) / kBlockBytes : 0;
+    blocks(rgb, full, keys);
+
+    size_t done = full * BlockPixels;
+    size_t rest = count - done;
+    if (rest == 0) return;
+    alignas(64) unsigned char pad[2 * kBlockBytes + 4] = {};
+    alignas(64) std::uint32_t padKeys[2 * BlockPixels];
+    std::copy_n(rgb + done * 3, rest * 3, pad);
+    blocks(pad, (rest + BlockPixels - 1) / BlockPixels, padKeys);
+    std::copy_n(padKeys, rest, keys + done);
+}
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define IMAGEREADER_X86 1
+#if defined(__GNUC__) || defined(__clang__)
+#define IMAGEREADER_TARGET(isa) __attribute__((target(isa)))
+#else
+#define IMAGEREADER_TARGET(isa)
+#endif
+
+// SSE2 has no byte shuffle, so samples are gathered with scalar loads; the
+// float math still runs four pixels wide. 16 pixels per block.
+IMAGEREADER_TARGET("sse2")
+void SSE2Blocks(const unsigned char* rgb, size_t blocks, std::uint32_t* keys) {
+    const __m128 wr = _mm_set1_ps(0.299f), wg = _mm_set1_ps(0.587f), wb = _mm_set1_ps(0.114f);
+    for (size_t n = 0; n < blocks * 4; ++n, rgb += 12, keys += 4) {
+        __m128 r = _mm_cvtepi32_ps(_mm_setr_epi32(rgb[0], rgb[3], rgb[6], rgb[9]));
+        __m128 g = _mm_cvtepi32_ps(_mm_setr_epi32(rgb[1], rgb[4], rgb[7], rgb[10]));
+        __m128 b = _mm_cvtepi32_ps(_mm_setr_epi32(rgb[2], rgb[5], rgb[8], rgb[11]));
+        __m128 luminance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(wr, r), _mm_mul_ps(wg, g)), _mm_mul_ps(wb, b));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(keys), _mm_castps_si128(luminance));
+    }
+}
+
+// Each 128-bit lane holds 4 pixels (12 of its 16 bytes); the shuffles spread
+// one channel of those pixels into 32-bit slots, zero-extended.
+#define IMAGEREADER_CHANNEL_MASK(c) \
+    c, -1, -1, -1, c + 3, -1, -1, -1, c + 6, -1, -1, -1, c + 9, -1, -1, -1
+
+// 16 pixels per block: two 8-pixel halves, each loaded as two 4-pixel lanes
+IMAGEREADER_TARGET("avx2")
+void AVX2Blocks(const unsigned char* rgb, size_t blocks, std::uint32_t* keys) {
+    const __m256i maskR = _mm256_setr_epi8(IMAGEREADER_CHANNEL_MASK(0), IMAGEREADER_CHANNEL_MASK(0));
+    const __m256i maskG = _mm256_setr_epi8(IMAGEREADER_CHANNEL_MASK(1), IMAGEREADER_CHANNEL_MASK(1));
+    const __m256i maskB = _mm256_setr_epi8(IMAGEREADER_CHANNEL_MASK(2), IMAGEREADER_CHANNEL_MASK(2));
+    const __m256 wr = _mm256_set1_ps(0.299f), wg = _mm256_set1_ps(0.587f), wb = _mm256_set1_ps(0.114f);
+    for (size_t n = 0; n < blocks * 2; ++n, rgb += 24, keys += 8) {
+        __m256i v = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(rgb))),
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(rgb + 12)), 1);
+        __m256 r = _mm256_cvtepi32_ps(_mm256_shuffle_epi8(v, maskR));
+        __m256 g = _mm256_cvtepi32_ps(_mm256_shuffle_epi8(v, maskG));
+        __m256 b = _mm256_cvtepi32_ps(_mm256_shuffle_epi8(v, maskB));
+        __m256 luminance = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(wr, r), _mm256_mul_ps(wg, g)),
+                                         _mm256_mul_ps(wb, b));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(keys), _mm256_castps_si256(luminance));
+    }
+}
+
+// Shuffle masks for the AVX-512 kernel, one 64-byte row per channel. Loaded
+// straight from memory: GCC 12 flags the undefined upper lanes that
+// _mm512_broadcast_i32x4 starts from as uninitialized.
+#define IMAGEREADER_CHANNEL_MASK4(c) \
+    IMAGEREADER_CHANNEL_MASK(c), IMAGEREADER_CHANNEL_MASK(c), IMAGEREADER_CHANNEL_MASK(c), IMAGEREADER_CHANNEL_MASK(c)
+alignas(64) inline constexpr signed char kAVX512Masks[3][64] = {
+    {IMAGEREADER_CHANNEL_MASK4(0)}, {IMAGEREADER_CHANNEL_MASK4(1)}, {IMAGEREADER_CHANNEL_MASK4(2)}};
+#undef IMAGEREADER_CHANNEL_MASK4
+
+// 32 pixels per block: two 16-pixel halves, each loaded as four 4-pixel lanes.
+// _mm512_cvtepi32_ps is built on an undefined passthrough vector that GCC 12
+// reports as maybe-uninitialized; the warning is silenced for this kernel only.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+IMAGEREADER_TARGET("avx512f,avx512bw")
+void AVX512Blocks(const unsigned char* rgb, size_t blocks, std::uint32_t* keys) {
+    const __m512i maskR = _mm512_load_si512(kAVX512Masks[0]);
+    const __m512i maskG = _mm512_load_si512(kAVX512Masks[1]);
+    const __m512i maskB = _mm512_load_si512(kAVX512Masks[2]);
+    const __m512 wr = _mm512_set1_ps(0.299f), wg = _mm512_set1_ps(0.587f), wb = _mm512_set1_ps(0.114f);
+    for (size_t n = 0; n < blocks * 2; ++n, rgb += 48, keys += 16) {
+        __m512i v = _mm512_castsi128_si512(_mm_loadu_si128(reinterpret_cast<const __m128i*>(rgb)));
+        v = _mm512_inserti32x4(v, _mm_loadu_si128(reinterpret_cast<const __m128i*>(rgb + 12)), 1);
+        v = _mm512_inserti32x4(v, _mm_loadu_si128(reinterpret_cast<const __m128i*>(rgb + 24)), 2);
+        v = _mm512_inserti32x4(v, _mm_loadu_si128(reinterpret_cast<const __m128i*>(rgb + 36)), 3);
+        __m512 r = _mm512_cvtepi32_ps(_mm512_shuffle_epi8(v, maskR));
+        __m512 g = _mm512_cvtepi32_ps(_mm512_shuffle_epi8(v, maskG));
+        __m512 b = _mm512_cvtepi32_ps(_mm512_shuffle_epi8(v, maskB));
+        __m512 luminance = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(wr, r), _mm512_mul_ps(wg, g)),
+                                         _mm512_mul_ps(wb, b));
+        _mm512_storeu_si512(keys, _mm512_castps_si512(luminance));
+    }
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#undef IMAGEREADER_CHANNEL_MASK
+
+inline void SSE2(const unsigned char* rgb, size_t count, std::uint32_t* keys) { Run<16>(SSE2Blocks, rgb, count, keys); }
+inline void AVX2(const unsigned char* rgb, size_t count, std::uint32_t* keys) { Run<16>(AVX2Blocks, rgb, count, keys); }
+inline void AVX512(const unsigned char* rgb, size_t count, std::uint32_t* keys) { Run<32>(AVX512Blocks, rgb, count, keys); }
+
+struct CpuFeatures {
+    bool sse2 = false, avx2 = false, avx512 = false;
+};
+
+inline CpuFeatures DetectCpu() {
+    CpuFeatures features;
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 0);
+    int maxLeaf = info[0];
+    __cpuid(info, 1);
+    features.sse2 = (info[3] >> 26) & 1;
+    bool osxsave = (info[2] >> 27) & 1;
+    unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+    if (maxLeaf >= 7) {
+        __cpuidex(info, 7, 0);
+        features.avx2 = ((info[1] >> 5) & 1) && (xcr0 & 0x6) == 0x6;
+        features.avx512 = ((info[1] >> 16) & 1) && ((info[1] >> 30) & 1) && (xcr0 & 0xE6) == 0xE6;
+    }
+#else
+    __builtin_cpu_init();
+    features.sse2 = __builtin_cpu_supports("sse2");
+    features.avx2 = __builtin_cpu_supports("avx2");
+    features.avx512 = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+#endif
+    return features;
+}
+#endif
+
+inline Kernel Select() {
+    const char* forced = std::getenv("IMAGEREADER_SIMD");
+    std::string name = forced ? forced : "";
+#ifdef IMAGEREADER_X86
+    CpuFeatures cpu = DetectCpu();
+    if (cpu.avx512 && (name.empty() || name == "avx512")) return AVX512;
+    if (cpu.avx2 && (name.empty() || name == "avx512" || name == "avx2")) return AVX2;
+    if (cpu.sse2 && name != "scalar") return SSE2;
+#endif
+    return Scalar;
+}
+
+inline void Compute(const unsigned char* rgb, size_t count, std::uint32_t* keys) {
+    static const Kernel kernel = Select();
+    kernel(rgb, count, keys);
+}
+
+} // namespace Luminance
+
+// Read-only mapping of a whole regular file. Pipes, sockets and platforms
+// without mmap leave it empty, and callers fall back to buffered reads.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& filename) {
+#ifdef IMAGEREADER_POSIX
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat info;
+        if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+            void* mapping = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping != MAP_FAILED) {
+                data = static_cast<const unsigned char*>(mapping);
+                size = static_cast<size_t>(info.st_size);
+                madvise(mapping, size, MADV_SEQUENTIAL);
+                madvise(mapping, size, MADV_WILLNEED);
+            }
+        }
+        close(fd);
+#else
+        (void)filename;
+#endif
+    }
+    ~MappedFile() {
+#ifdef IMAGEREADER_POSIX
+        if (data) munmap(const_cast<unsigned char*>(data), size);
+#endif
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const unsigned char* Data() const { return data; }
+    size_t Size() const { return size; }
+
+private:
+    const unsigned char* data = nullptr;
+    size_t size = 0;
+};
+
+// Lets the istream based header parser run over mapped memory
+class MemoryStreamBuf : public std::streambuf {
+public:
+    MemoryStreamBuf(const unsigned char* data, size_t size) {
+        char* begin = reinterpret_cast<char*>(const_cast<unsigned char*>(data));
+        setg(begin, begin, begin + size);
+    }
+    size_t Consumed() const { return static_cast<size_t>(gptr() - eback()); }
+};
+
+// Chrome trace events for --trace, loadable in chrome://tracing or Perfetto.
+// A Span is one complete event on the thread that opens it. Pool tasks are
+// spans too, named after the span that submitted them, so a stage's work shows
+// up on every thread that helped with it. Nothing is kept until Enable().
+class TraceLog {
+public:
+    struct Event {
+        std::string name;
+        std::string subject;
+        const char* category;
+        unsigned thread;
+        double startUs, durationUs;
+    };
+
+    class Span {
+    public:
+        Span(std::string name, const char* category, std::string subject = {});
+        ~Span();
+        Span(const Span&) = delete;
+        Span& operator=(const Span&) = delete;
+
+        const std::string& Name() const { return event.name; }
+        const std::string& Subject() const { return event.subject; }
+
+    private:
+        bool active;
+        Event event;
+        const Span* parent = nullptr;
+    };
+
+    static TraceLog& Instance() {
+        static TraceLog log;
+        return log;
+    }
+
+    void Enable() { enabled.store(true, std::memory_order_relaxed); }
+    bool Enabled() const { return enabled.load(std::memory_order_relaxed); }
+    void Add(Event event);
+    void Write(const std::string& filename) const; // throws when the file can't be written
+
+    // Small stable id for the calling thread, and a label for it in the trace
+    static unsigned ThreadId();
+    void NameThread(std::string name);
+    // Innermost open span on the calling thread, nullptr outside any span
+    static const Span* Current() { return current; }
+
+    double ElapsedUs() const {
+        return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    }
+
+private:
+    TraceLog() = default;
+
+    std::atomic<bool> enabled{false};
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    mutable std::mutex mutex;
+    std::vector<Event> events;
+    std::vector<std::pair<unsigned, std::string>> threadNames;
+    static inline std::atomic<unsigned> nextThreadId{0};
+    static inline thread_local const Span* current = nullptr;
+};
+
+TraceLog::Span::Span(std::string name, const char* category, std::string subject)
+    : active(TraceLog::Instance().Enabled()) {
+    if (!active) return;
+    event.name = std::move(name);
+    event.subject = std::move(subject);
+    event.category = category;
+    event.thread = ThreadId();
+    event.startUs = TraceLog::Instance().ElapsedUs();
+    parent = current;
+    current = this;
+}
+
+TraceLog::Span::~Span() {
+    if (!active) return;
+    current = parent;
+    event.durationUs = TraceLog::Instance().ElapsedUs() - event.startUs;
+    TraceLog::Instance().Add(std::move(event));
+}
+
+void TraceLog::Add(Event event) {
+    std::lock_guard<std::mutex> lock(mutex);
+    events.push_back(std::move(event));
+}
+
+unsigned TraceLog::ThreadId() {
+    static thread_local unsigned id = nextThreadId++;
+    return id;
+}
+
+void TraceLog::NameThread(std::string name) {
+    unsigned id = ThreadId();
+    std::lock_guard<std::mutex> lock(mutex);
+    threadNames.emplace_back(id, std::move(name));
+}
+
+// Hardware counters for --perf, Linux only. They are opened with inherit on
+// the main thread before the pool starts, so the workers count into them as
+// well; like CPU time they are process-wide. Counters the CPU or kernel
+// doesn't offer (common in VMs) read as -1. Values are scaled up when the
+// kernel had to multiplex them.
+class PerfCounters {
+public:
+    enum Counter { Cycles, Instructions, LlcMisses, BranchMisses, DtlbMisses, kCounters };
+    using Values = std::array<double, kCounters>;
+
+    static PerfCounters& Instance() {
+        static PerfCounters counters;
+        return counters;
+    }
+    ~PerfCounters() {
+#ifdef __linux__
+        for (int fd : fds) {
+            if (fd >= 0) close(fd);
+        }
+#endif
+    }
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    // Must run before any other thread is started. Returns false, with the
+    // reason in error, when not a single counter could be opened.
+    bool Open(std::string& error);
+    bool Enabled() const { return enabled; }
+    Values Read() const;
+
+    static const char* Name(int counter) {
+        static const char* const names[kCounters] = {"cycles", "instructions", "llcMisses", "branchMisses", "dtlbMisses"};
+        return names[counter];
+    }
+
+private:
+    PerfCounters() { fds.fill(-1); }
+
+    std::array<int, kCounters> fds;
+    bool enabled = false;
+};
+
+bool PerfCounters::Open(std::string& error) {
+#ifdef __linux__
+    const std::pair<std::uint32_t, std::uint64_t> events[kCounters] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    };
+    for (int counter = 0; counter < kCounters; ++counter) {
+        perf_event_attr attr{};
+        attr.size = sizeof(attr);
+        attr.type = events[counter].first;
+        attr.config = events[counter].second;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        fds[counter] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC));
+        if (fds[counter] < 0 && error.empty()) {
+            error = std::string("perf_event_open: ") + std::strerror(errno);
+        }
+    }
+    enabled = std::any_of(fds.begin(), fds.end(), [](int fd) { return fd >= 0; });
+    return enabled;
+#else
+    error = "hardware counters need Linux perf_event_open";
+    return false;
+#endif
+}
+
+PerfCounters::Values PerfCounters::Read() const {
+    Values values;
+    values.fill(-1);
+#ifdef __linux__
+    for (int counter = 0; counter < kCounters; ++counter) {
+        std::uint64_t data[3] = {}; // value, time enabled, time running
+        if (fds[counter] < 0 || read(fds[counter], data, sizeof(data)) != static_cast<ssize_t>(sizeof(data))) continue;
+        values[counter] = data[2] ? static_cast<double>(data[0]) * data[1] / data[2] : 0.0;
+    }
+#endif
+    return values;
+}
+
+// Allocation accounting for --report: every global operator new, plain or
+// aligned, array or not, goes through the replacements below and bumps two
+// relaxed counters. Memory the C libraries (libjpeg, libpng, zlib) take from
+// malloc directly isn't seen.
+namespace AllocationStats {
+std::atomic<std::uint64_t> allocations{0};
+std::atomic<std::uint64_t> bytes{0};
+
+void* Allocate(std::size_t size, std::size_t alignment) noexcept {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    bytes.fetch_add(size, std::memory_order_relaxed);
+    size = std::max<std::size_t>(size, 1);
+    if (alignment <= alignof(std::max_align_t)) return std::malloc(size);
+#ifdef _WIN32
+    return _aligned_malloc(size, alignment);
+#else
+    void* block = nullptr;
+    return posix_memalign(&block, alignment, size) == 0 ? block : nullptr;
+#endif
+}
+
+void* AllocateOrThrow(std::size_t size, std::size_t alignment) {
+    void* block = Allocate(size, alignment);
+    if (!block) throw std::bad_alloc();
+    return block;
+}
+
+// Kept out of line: once inlined into operator delete, GCC sees free() on a
+// pointer from operator new and reports -Wmismatched-new-delete at -O1
+#if defined(__GNUC__) && !defined(__clang__)
+__attribute__((noinline))
+#endif
+void Free(void* block, std::size_t alignment) noexcept {
+#ifdef _WIN32
+    if (alignment > alignof(std::max_align_t)) {
+        _aligned_free(block);
+        return;
+    }
+#else
+    (void)alignment;
+#endif
+    std::free(block);
+}
+} // namespace AllocationStats
+
+void* operator new(std::size_t size) { return AllocationStats::AllocateOrThrow(size, 0); }
+void* operator new[](std::size_t size) { return AllocationStats::AllocateOrThrow(size, 0); }
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept { return AllocationStats::Allocate(size, 0); }
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept { return AllocationStats::Allocate(size, 0); }
+void* operator new(std::size_t size, std::align_val_t alignment) {
+    return AllocationStats::AllocateOrThrow(size, static_cast<std::size_t>(alignment));
+}
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+    return AllocationStats::AllocateOrThrow(size, static_cast<std::size_t>(alignment));
+}
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return AllocationStats::Allocate(size, static_cast<std::size_t>(alignment));
+}
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return AllocationStats::Allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void* block) noexcept { AllocationStats::Free(block, 0); }
+void operator delete[](void* block) noexcept { AllocationStats::Free(block, 0); }
+void operator delete(void* block, std::size_t) noexcept { AllocationStats::Free(block, 0); }
+void operator delete[](void* block, std::size_t) noexcept { AllocationStats::Free(block, 0); }
+void operator delete(void* block, const std::nothrow_t&) noexcept { AllocationStats::Free(block, 0); }
+void operator delete[](void* block, const std::nothrow_t&) noexcept { AllocationStats::Free(block, 0); }
+void operator delete(void* block, std::align_val_t alignment) noexcept {
+    AllocationStats::Free(block, static_cast<std::size_t>(alignment));
+}
+void operator delete[](void* block, std::align_val_t alignment) noexcept {
+    AllocationStats::Free(block, static_cast<std::size_t>(alignment));
+}
+void operator delete(void* block, std::size_t, std::align_val_t alignment) noexcept {
+    AllocationStats::Free(block, static_cast<std::size_t>(alignment));
+}
+void operator delete[](void* block, std::size_t, std::align_val_t alignment) noexcept {
+    AllocationStats::Free(block, static_cast<std::size_t>(alignment));
+}
+void operator delete(void* block, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    AllocationStats::Free(block, static_cast<std::size_t>(alignment));
+}
+void operator delete[](void* block, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    AllocationStats::Free(block, static_cast<std::size_t>(alignment));
+}
+
+// Resident set size from /proc/self/status: VmRSS now and the VmHWM peak,
+// in KB, -1 where unavailable. ResetPeak() drops VmHWM back to the current
+// RSS through /proc/self/clear_refs (Linux 4.0+). Plain stdio throughout, so
+// sampling doesn't show up in the allocation counts.
+namespace ResidentMemory {
+struct Sample {
+    long long currentKB = -1;
+    long long peakKB = -1;
+};
+
+Sample Read() {
+    Sample sample;
+#ifdef __linux__
+    std::FILE* status = std::fopen("/proc/self/status", "r");
+    if (!status) return sample;
+    char line[256];
+    while (std::fgets(line, sizeof(line), status)) {
+        std::sscanf(line, "VmRSS: %lld", &sample.currentKB);
+        std::sscanf(line, "VmHWM: %lld", &sample.peakKB);
+    }
+    std::fclose(status);
+#endif
+    return sample;
+}
+
+bool ResetPeak() {
+#ifdef __linux__
+    std::FILE* clearRefs = std::fopen("/proc/self/clear_refs", "w");
+    if (!clearRefs) return false;
+    bool written = std::fputs("5", clearRefs) >= 0;
+    return std::fclose(clearRefs) == 0 && written;
+#else
+    return false;
+#endif
+}
+} // namespace ResidentMemory
+
+// Per-stage measurements for --report. A Stage measures from construction to
+// destruction on whichever thread runs it, and stages may overlap. CPU time is
+// the whole process's, so two stages running side by side both count the
+// other's work too; the same goes for allocations. A stage's peak RSS delta
+// is the highest VmHWM seen while it ran minus VmRSS at its start. Each stage
+// resets VmHWM when it starts, after folding the old value into the peaks of
+// the stages still running, so overlapping stages keep correct peaks.
+// Nothing is measured or kept until Enable() is called.
+class RunReport {
+public:
+    struct Record {
+        std::string name;    // what ran, e.g. "sort"
+        std::string subject; // what it ran on, e.g. "obrazA.jpg"
+        double startMs = 0, wallMs = 0, cpuMs = 0;
+        std::uint64_t pixels = 0;
+        std::uint64_t bytes = 0; // image payload processed; file size for decode and save stages
+        bool hasCounters = false;
+        PerfCounters::Values counters{}; // deltas, -1 where a counter is unavailable
+        std::uint64_t allocations = 0, allocatedBytes = 0; // through operator new
+        long long rssStartKB = -1, peakRssDeltaKB = -1; // -1 = unavailable
+    };
+
+    class Stage {
+    public:
+        // Also a "stage" span in the trace
+        Stage(std::string name, std::string subject = {}, std::uint64_t pixels = 0, std::uint64_t bytes = 0);
+        ~Stage();
+        Stage(const Stage&) = delete;
+        Stage& operator=(const Stage&) = delete;
+
+        // For work only known once the stage has run, e.g. a decoded size
+        void SetWork(std::uint64_t pixels, std::uint64_t bytes) {
+            record.pixels = pixels;
+            record.bytes = bytes;
+        }
+
+    private:
+        friend class RunReport; // folds peaks into running stages
+
+        TraceLog::Span span;
+        bool active;
+        Record record;
+        double cpuStart = 0;
+        PerfCounters::Values countersStart{};
+        std::uint64_t allocationsStart = 0, bytesStart = 0;
+        long long peakKB = -1; // highest VmHWM seen since the stage started
+    };
+
+    static RunReport& Instance() {
+        static RunReport report;
+        return report;
+    }
+
+    void Enable() { enabled.store(true, std::memory_order_relaxed); }
+    bool Enabled() const { return enabled.load(std::memory_order_relaxed); }
+    void Add(Record record);
+    void Write(const std::string& filename) const; // throws when the file can't be written
+    void PrintCounters(std::ostream& output) const;
+
+    double ElapsedMs() const {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+    static double CpuMs();
+    static std::string Escape(const std::string& text);
+
+private:
+    RunReport() = default;
+    std::vector<Record> SortedRecords() const;
+    void BeginMemory(Stage& stage);
+    void EndMemory(Stage& stage);
+    void FoldPeak(long long peakKB);
+
+    std::atomic<bool> enabled{false};
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    mutable std::mutex mutex;
+    std::vector<Record> records;
+    mutable std::mutex memoryMutex;
+    std::vector<Stage*> runningStages; // guarded by memoryMutex
+    long long processPeakKB = -1; // VmHWM is reset per stage, so the process peak is kept here
+};
+
+RunReport::Stage::Stage(std::string name, std::string subject, std::uint64_t pixels, std::uint64_t bytes)
+    : span(name, "stage", subject), active(RunReport::Instance().Enabled()) {
+    if (!active) return;
+    record.name = std::move(name);
+    record.subject = std::move(subject);
+    record.pixels = pixels;
+    record.bytes = bytes;
+    record.startMs = RunReport::Instance().ElapsedMs();
+    cpuStart = CpuMs();
+    record.hasCounters = PerfCounters::Instance().Enabled();
+    if (record.hasCounters) countersStart = PerfCounters::Instance().Read();
+    RunReport::Instance().BeginMemory(*this);
+    allocationsStart = AllocationStats::allocations.load(std::memory_order_relaxed);
+    bytesStart = AllocationStats::bytes.load(std::memory_order_relaxed);
+}
+
+RunReport::Stage::~Stage() {
+    if (!active) return;
+    record.wallMs = RunReport::Instance().ElapsedMs() - record.startMs;
+    record.cpuMs = CpuMs() - cpuStart;
+    record.allocations = AllocationStats::allocations.load(std::memory_order_relaxed) - allocationsStart;
+    record.allocatedBytes = AllocationStats::bytes.load(std::memory_order_relaxed) - bytesStart;
+    RunReport::Instance().EndMemory(*this);
+    if (record.hasCounters) {
+        PerfCounters::Values end = PerfCounters::Instance().Read();
+        for (int counter = 0; counter < PerfCounters::kCounters; ++counter) {
+            bool available = countersStart[counter] >= 0 && end[counter] >= 0;
+            record.counters[counter] = available ? std::max(0.0, end[counter] - countersStart[counter]) : -1;
+        }
+    }
+    RunReport::Instance().Add(std::move(record));
+}
+
+// Called with memoryMutex held: every running stage has seen peakKB
+void RunReport::FoldPeak(long long peakKB) {
+    processPeakKB = std::max(processPeakKB, peakKB);
+    for (Stage* stage : runningStages) {
+        stage->peakKB = std::max(stage->peakKB, peakKB);
+    }
+}
+
+void RunReport::BeginMemory(Stage& stage) {
+    std::lock_guard<std::mutex> lock(memoryMutex);
+    FoldPeak(ResidentMemory::Read().peakKB);
+    if (ResidentMemory::ResetPeak()) {
+        stage.record.rssStartKB = ResidentMemory::Read().currentKB;
+        stage.peakKB = stage.record.rssStartKB;
+    }
+    runningStages.push_back(&stage);
+}
+
+void RunReport::EndMemory(Stage& stage) {
+    std::lock_guard<std::mutex> lock(memoryMutex);
+    FoldPeak(ResidentMemory::Read().peakKB);
+    runningStages.erase(std::find(runningStages.begin(), runningStages.end(), &stage));
+    if (stage.record.rssStartKB >= 0 && stage.peakKB >= 0) {
+        stage.record.peakRssDeltaKB = stage.peakKB - stage.record.rssStartKB;
+    }
+}
+
+void RunReport::Add(Record record) {
+    std::lock_guard<std::mutex> lock(mutex);
+    records.push_back(std::move(record));
+}
+
+double RunReport::CpuMs() {
+#ifdef IMAGEREADER_POSIX
+    timespec now{};
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+#else
+    return 1e3 * static_cast<double>(std::clock()) / CLOCKS_PER_SEC;
+#endif
+}
+
+std::string RunReport::Escape(const std::string& text) {
+    std::string escaped;
+    for (unsigned char c : text) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += static_cast<char>(c);
+        } else if (c < 0x20) {
+            char code[8];
+            std::snprintf(code, sizeof(code), "\\u%04x", c);
+            escaped += code;
+        } else {
+            escaped += static_cast<char>(c);
+        }
+    }
+    return escaped;
+}
+
+// {"version": 1, "wallMs", "cpuMs", "peakRssKB", "stages": [...]}, stages in
+// start order. mpPerSec is pixels over wall time, 0 for stages that don't work
+// on pixels. Unavailable memory figures are null.
+// With --perf each stage also gets "counters": the raw counts, "ipc" and
+// "<counter>PerPixel"; unavailable counters are null.
+std::vector<RunReport::Record> RunReport::SortedRecords() const {
+    std::vector<Record> stages;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stages = records;
+    }
+    std::stable_sort(stages.begin(), stages.end(), [](const Record& a, const Record& b) {
+        return a.startMs < b.startMs;
+    });
+    return stages;
+}
+
+void RunReport::Write(const std::string& filename) const {
+    std::vector<Record> stages = SortedRecords();
+    long long peakKB = ResidentMemory::Read().peakKB;
+    {
+        std::lock_guard<std::mutex> lock(memoryMutex);
+        peakKB = std::max(peakKB, processPeakKB);
+    }
+    auto kilobytes = [](long long value) { return value < 0 ? std::string("null") : std::to_string(value); };
+
+    std::ofstream output(filename);
+    if (!output) throw std::runtime_error("Could not create '" + filename + "'");
+    output << "{\n  \"version\": 1,\n  \"wallMs\": " << ElapsedMs() << ",\n  \"cpuMs\": " << CpuMs()
+           << ",\n  \"peakRssKB\": " << kilobytes(peakKB) << ",\n  \"stages\": [";
+    for (size_t i = 0; i < stages.size(); ++i) {
+        const Record& stage = stages[i];
+        double mpPerSec = stage.wallMs > 0 ? stage.pixels / 1e3 / stage.wallMs : 0.0;
+        output << (i ? "," : "") << "\n    {\"name\": \"" << Escape(stage.name) << "\", \"subject\": \""
+               << Escape(stage.subject) << "\", \"startMs\": " << stage.startMs << ", \"wallMs\": " << stage.wallMs
+               << ", \"cpuMs\": " << stage.cpuMs << ", \"pixels\": " << stage.pixels << ", \"bytes\": "
+               << stage.bytes << ", \"mpPerSec\": " << mpPerSec << ", \"allocations\": " << stage.allocations
+               << ", \"allocatedBytes\": " << stage.allocatedBytes << ", \"rssStartKB\": " << kilobytes(stage.rssStartKB)
+               << ", \"peakRssDeltaKB\": " << kilobytes(stage.peakRssDeltaKB);
+        if (stage.hasCounters) {
+            // Counts as integers, ratios to 4 significant digits; the stream's
+            // format is put back afterwards for the next stage's fields
+            std::ios_base::fmtflags flags = output.flags();
+            std::streamsize precision = output.precision();
+            auto number = [&output](double value) -> std::ostream& {
+                return value < 0 ? output << "null" : output << std::fixed << std::setprecision(0) << value;
+            };
+            auto ratio = [&output](double value, double over) -> std::ostream& {
+                return value < 0 || over <= 0 ? output << "null"
+                                              : output << std::defaultfloat << std::setprecision(4) << value / over;
+            };
+            const auto& counters = stage.counters;
+            output << ", \"counters\": {";
+            for (int counter = 0; counter < PerfCounters::kCounters; ++counter) {
+                output << "\"" << PerfCounters::Name(counter) << "\": ";
+                number(counters[counter]) << ", ";
+            }
+            output << "\"ipc\": ";
+            ratio(counters[PerfCounters::Instructions], counters[PerfCounters::Cycles]);
+            for (int counter : {PerfCounters::LlcMisses, PerfCounters::BranchMisses, PerfCounters::DtlbMisses}) {
+                output << ", \"" << PerfCounters::Name(counter) << "PerPixel\": ";
+                ratio(counters[counter], static_cast<double>(stage.pixels));
+            }
+            output << "}";
+            output.flags(flags);
+            output.precision(precision);
+        }
+        output << "}";
+    }
+    output << (stages.empty() ? "" : "\n  ") << "]\n}\n";
+    if (!output) throw std::runtime_error("Could not write '" + filename + "'");
+}
+
+// {"traceEvents": [...]}: a thread_name record per named thread, then one
+// complete ("X") event per span with microsecond timestamps; fixed notation
+// keeps nanosecond resolution however long the run gets
+void TraceLog::Write(const std::string& filename) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::ofstream output(filename);
+    if (!output) throw std::runtime_error("Could not create '" + filename + "'");
+    output << std::fixed << std::setprecision(3);
+    output << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+    const char* separator = "\n  ";
+    for (const auto& [thread, name] : threadNames) {
+        output << separator << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << thread
+               << ", \"args\": {\"name\": \"" << RunReport::Escape(name) << "\"}}";
+        separator = ",\n  ";
+    }
+    for (const auto& event : events) {
+        output << separator << "{\"name\": \"" << RunReport::Escape(event.name) << "\", \"cat\": \"" << event.category
+               << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << event.thread << ", \"ts\": " << event.startUs
+               << ", \"dur\": " << event.durationUs << ", \"args\": {\"subject\": \"" << RunReport::Escape(event.subject)
+               << "\"}}";
+        separator = ",\n  ";
+    }
+    output << "\n]}\n";
+    if (!output) throw std::runtime_error("Could not write '" + filename + "'");
+}
+
+// One line per stage: IPC and misses per pixel, "-" where unavailable
+void RunReport::PrintCounters(std::ostream& output) const {
+    auto cell = [](double value, double over) {
+        if (value < 0 || over <= 0) return std::string("-");
+        char text[32];
+        std::snprintf(text, sizeof(text), "%.3f", value / over);
+        return std::string(text);
+    };
+    char line[256];
+    std::snprintf(line, sizeof(line), "%-22s %-16s %8s %10s %10s %10s\n", "stage", "subject", "IPC", "LLC/px",
+                  "branch/px", "dTLB/px");
+    output << line;
+    for (const Record& stage : SortedRecords()) {
+        if (!stage.hasCounters) continue;
+        double pixels = static_cast<double>(stage.pixels);
+        const auto& counters = stage.counters;
+        std::snprintf(line, sizeof(line), "%-22s %-16s %8s %10s %10s %10s\n", stage.name.c_str(), stage.subject.c_str(),
+                      cell(counters[PerfCounters::Instructions], counters[PerfCounters::Cycles]).c_str(),
+                      cell(counters[PerfCounters::LlcMisses], pixels).c_str(),
+                      cell(counters[PerfCounters::BranchMisses], pixels).c_str(),
+                      cell(counters[PerfCounters::DtlbMisses], pixels).c_str());
+        output << line;
+    }
+}
+
+// Fixed-size worker pool shared by every stage. Each worker owns a deque: it
+// pops its own newest task and, when that runs dry, steals the oldest task from
+// the others. A thread that waits on a task (Wait, ParallelFor) runs queued
+// tasks in the meantime, so stages can nest without starving the pool.
+class ThreadPool {
+public:
+    explicit ThreadPool(unsigned threads) {
+        threads = std::max(1u, threads);
+        for (unsigned i = 0; i < threads; ++i) {
+            queues.push_back(std::make_unique<Queue>());
+        }
+        for (unsigned i = 0; i < threads; ++i) {
+            workers.emplace_back([this, i]() { WorkerLoop(i); });
+        }
+    }
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Sized on first use from Configure(), else IMAGEREADER_THREADS, else AvailableCpus()
+    static ThreadPool& Instance() {
+        static ThreadPool pool(configuredThreads ? configuredThreads : DefaultThreads());
+        return pool;
+    }
+    // Only takes effect when called before the first Instance()
+    static void Configure(unsigned threads) { configuredThreads = threads; }
+    static unsigned AvailableCpus();
+
+    unsigned Size() const { return static_cast<unsigned>(workers.size()); }
+
+    // How many tasks to split `items` into so each gets at least minPerTask
+    unsigned TasksFor(size_t items, size_t minPerTask) const {
+        return static_cast<unsigned>(std::clamp<size_t>(items / std::max<size_t>(minPerTask, 1), 1, Size()));
+    }
+
+    template <typename F>
+    auto Submit(F&& f) -> std::future<std::invoke_result_t<std::decay_t<F>>> {
+        using Result = std::invoke_result_t<std::decay_t<F>>;
+        auto task = std::make_shared<std::packaged_task<Result()>>(std::forward<F>(f));
+        std::future<Result> result = task->get_future();
+        if (TraceLog::Instance().Enabled()) {
+            const TraceLog::Span* parent = TraceLog::Current();
+            std::string name = parent ? parent->Name() : "task";
+            std::string subject = parent ? parent->Subject() : std::string();
+            Push([task, name = std::move(name), subject = std::move(subject)]() {
+                TraceLog::Span span(name, "task", subject);
+                (*task)();
+            });
+        } else {
+            Push([task]() { (*task)(); });
+        }
+        return result;
+    }
+
+    template <typename T>
+    T Wait(std::future<T>& future) {
+        while (future.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            if (!RunOne()) future.wait_for(std::chrono::microseconds(100));
+        }
+        return future.get();
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    std::atomic<size_t> pending{0};
+    std::atomic<unsigned> nextQueue{0};
+    bool stopping = false;
+
+    static inline unsigned configuredThreads = 0;
+    static inline thread_local ThreadPool* currentPool = nullptr;
+    static inline thread_local unsigned currentIndex = 0;
+
+    static unsigned DefaultThreads() {
+        const char* forced = std::getenv("IMAGEREADER_THREADS");
+        int threads = forced ? std::atoi(forced) : 0;
+        return threads > 0 ? static_cast<unsigned>(threads) : AvailableCpus();
+    }
+
+    void Push(std::function<void()> task) {
+        unsigned index = currentPool == this ? currentIndex : nextQueue++ % Size();
+        {
+            std::lock_guard<std::mutex> lock(queues[index]->mutex);
+            queues[index]->tasks.push_back(std::move(task));
+        }
+        ++pending;
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+        }
+        wake.notify_one();
+    }
+
+    bool TryPop(Queue& queue, bool newest, std::function<void()>& task) {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) return false;
+        if (newest) {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        } else {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+        return true;
+    }
+
+    // Runs one queued task on the calling thread; false if there was none
+    bool RunOne() {
+        std::function<void()> task;
+        bool isWorker = currentPool == this;
+        unsigned self = isWorker ? currentIndex : 0;
+        bool found = isWorker && TryPop(*queues[self], true, task);
+        for (unsigned k = isWorker ? 1 : 0; !found && k < Size(); ++k) {
+            found = TryPop(*queues[(self + k) % Size()], false, task);
+        }
+        if (!found) return false;
+        --pending;
+        task();
+        return true;
+    }
+
+    void WorkerLoop(unsigned index) {
+        currentPool = this;
+        currentIndex = index;
+        TraceLog::Instance().NameThread("worker " + std::to_string(index));
+        while (true) {
+            if (RunOne()) continue;
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            wake.wait(lock, [this]() { return stopping || pending > 0; });
+            if (stopping && pending == 0) return;
+        }
+    }
+};
+
+// CPUs this process may really use: the affinity mask and the cgroup CPU
+// quota both cap the count. The process's own cgroup comes from
+// /proc/self/cgroup, and every ancestor up to the mount root caps it as well,
+// so the tightest quota along that path wins (v2 cpu.max, v1 cfs_quota_us /
+// cfs_period_us on the cpu controller).
+unsigned ThreadPool::AvailableCpus() {
+    unsigned cpus = std::max(1u, std::thread::hardware_concurrency());
+#ifdef __linux__
+    cpu_set_t affinity;
+    if (sched_getaffinity(0, sizeof(affinity), &affinity) == 0) {
+        cpus = std::min(cpus, static_cast<unsigned>(std::max(1, CPU_COUNT(&affinity))));
+    }
+
+    // Lines are "<id>:<controllers>:<path>"; "0::" is the v2 hierarchy
+    std::string v2Path, v1Path;
+    std::ifstream membership("/proc/self/cgroup");
+    for (std::string line; std::getline(membership, line);) {
+        size_t first = line.find(':'), second = line.find(':', first + 1);
+        if (first == std::string::npos || second == std::string::npos) continue;
+        std::string controllers = "," + line.substr(first + 1, second - first - 1) + ",";
+        if (line.compare(0, first, "0") == 0 && controllers == ",,") {
+            v2Path = line.substr(second + 1);
+        } else if (controllers.find(",cpu,") != std::string::npos) {
+            v1Path = line.substr(second + 1);
+        }
+    }
+
+    // Walks from root/path up to root, narrowing cpus by each level's quota.
+    // A path outside the mount (no cgroup namespace) falls back to the root.
+    auto applyQuotas = [&cpus](const fs::path& root, const std::string& path, auto readQuota) {
+        fs::path dir = (root / fs::path(path).relative_path()).lexically_normal();
+        if (!dir.has_filename()) dir = dir.parent_path();
+        bool found = false;
+        while (true) {
+            double quota = -1, period = 0;
+            if (readQuota(dir, quota, period)) {
+                found = true;
+                if (quota > 0 && period > 0) {
+                    cpus = std::min(cpus, static_cast<unsigned>(std::max(1.0, std::ceil(quota / period))));
+                }
+            }
+            if (dir == root || !dir.has_relative_path()) break;
+            dir = dir.parent_path();
+        }
+        return found;
+    };
+    auto readV2 = [](const fs::path& dir, double& quota, double& period) {
+        std::ifstream file(dir / "cpu.max");
+        std::string limit;
+        if (!(file >> limit >> period)) return false;
+        if (limit != "max") quota = std::atof(limit.c_str());
+        return true;
+    };
+    auto readV1 = [](const fs::path& dir, double& quota, double& period) {
+        std::ifstream quotaFile(dir / "cpu.cfs_quota_us");
+        std::ifstream periodFile(dir / "cpu.cfs_period_us");
+        return static_cast<bool>(quotaFile >> quota && periodFile >> period);
+    };
+    bool unified = applyQuotas("/sys/fs/cgroup", v2Path, readV2);
+    if (!unified) applyQuotas("/sys/fs/cgroup/cpu", v1Path, readV1);
+#endif
+    return cpus;
+}
+
+// Runs body(t) for every t in [0, tasks) on the pool, t == 0 on the calling
+// thread. Every task finishes before this returns, since they all reference
+// the caller's frame; the first exception thrown by any of them is rethrown.
+template <typename F>
+void ParallelFor(unsigned tasks, F&& body) {
+    ThreadPool& pool = ThreadPool::Instance();
+    std::vector<std::future<void>> workers;
+    std::exception_ptr failure;
+    try {
+        for (unsigned t = 1; t < tasks; ++t) {
+            workers.push_back(pool.Submit([&body, t]() { body(t); }));
+        }
+        if (tasks > 0) body(0);
+    } catch (...) {
+        failure = std::current_exception();
+    }
+    for (auto& worker : workers) {
+        try {
+            pool.Wait(worker);
+        } catch (...) {
+            if (!failure) failure = std::current_exception();
+        }
+    }
+    if (failure) std::rethrow_exception(failure);
+}
+
+// Splits [0, items) into contiguous ranges of at least minPerTask items and
+// runs body(first, last) for each of them on the pool
+template <typename F>
+void ParallelForRange(size_t items, size_t minPerTask, F&& body) {
+    unsigned tasks = ThreadPool::Instance().TasksFor(items, minPerTask);
+    ParallelFor(tasks, [&](unsigned t) {
+        body(items * t / tasks, items * (t + 1) / tasks);
+    });
+}
+
+class PPMImage {
+    friend class ExternalTransfer;
+
+public:
+    // Packed 24-bit pixel, laid out exactly like a P6 sample triplet
+    struct RGB {
+        unsigned char r, g, b;
+    };
+    static_assert(sizeof(RGB) == 3, "RGB must stay packed to 3 bytes");
+
+    // A sorted image's colors in ascending luminance order, i.e. what UpdatePixels
+    // hands out by rank. Keeping one around lets a single source recolor many targets.
+    // Save/Load persist it as an index file that Load maps instead of copying.
+    struct Palette {
+        int width = 0, height = 0;
+        int keyBits = 0; // how the colors were ranked: 0 = exact sort, else histogram key bits
+        std::vector<RGB> colors;
+        std::shared_ptr<const MappedFile> mapping; // set by Load, colors then stays empty
+
+        std::span<const RGB> Colors() const;
+        void Save(const std::string& filename) const;
+        static Palette Load(const std::string& filename);
+        static bool IsIndexFile(const std::string& filename);
+    };
+
+    // Sequential access to a P6 file a strip of whole rows at a time, so only
+    // the strip has to be in memory. Throws when the file isn't a readable P6
+    // or its payload ends early.
+    class StripReader {
+    public:
+        explicit StripReader(const std::string& filename);
+
+        // Reads up to rows rows into strip (room for rows * Width() pixels);
+        // returns how many were read, 0 once every row has been consumed
+        int Read(RGB* strip, int rows);
+
+        int Width() const { return width; }
+        int Height() const { return height; }
+        int NextRow() const { return nextRow; }
+        size_t Pixels() const { return static_cast<size_t>(width) * height; }
+
+    private:
+        std::string filename;
+        std::ifstream stream;
+        int width = 0, height = 0;
+        int nextRow = 0;
+    };
+
+    // Writes a P6 file top to bottom from strips of whole rows. The header goes
+    // out on construction; Close throws unless exactly Height() rows were written.
+    class StripWriter {
+    public:
+        StripWriter(const std::string& filename, int width, int height);
+
+        void Write(const RGB* strip, int rows);
+        void Close();
+
+        int Width() const { return width; }
+        int Height() const { return height; }
+        int NextRow() const { return nextRow; }
+
+    private:
+        std::string filename;
+        std::ofstream stream;
+        int width = 0, height = 0;
+        int nextRow = 0;
+    };
+
+    // Radix is O(N) and produces the same stable order as Comparison
+    enum class SortMode { Comparison, Radix };
+
+    // Auto streams small images and switches to Parallel past kParallelSaveBytes.
+    // Parallel and Mapped need POSIX and fall back to Stream elsewhere.
+    enum class SaveMode { Auto, Stream, Parallel, Mapped };
+    static constexpr size_t kParallelSaveBytes = size_t(64) << 20;
+    // Per-pixel loops are only split across the pool above this many pixels per task
+    static constexpr size_t kMinPixelsPerTask = size_t(256) << 10;
+
+    ~PPMImage() = default;
+    PPMImage() = default;
+    explicit PPMImage(const CImg<unsigned char>& image) { Import(image); }
+    
+    void Save(const std::string& filename);
+    void SavePNG(const std::string& filename) const;
+    CImg<unsigned char> ToCImg() const;
+    void Read(const std::string& filename);
+    void Import(const unsigned char* rgb, int newWidth, int newHeight);
+    void Import(const CImg<unsigned char>& image);
+    void Resize(int newHeight, int newWidth);
+    void ComputeLuminanceAndSort();
+    void UpdatePixels(PPMImage* source, PPMImage* target);
+    void UpdatePixels(const Palette& palette);
+    Palette ExtractPalette() const;
+
+    // Histogram mode: no global sort and no per-pixel key or index arrays. Pixels are
+    // bucketed by luminance at keyBits (8..16) precision; the palette lists colors
+    // bucket by bucket and the target takes them by its own per-bucket CDF ranks.
+    // Within a bucket pixels rank in raster order rather than by exact luminance,
+    // so a pixel takes a palette color from its bucket's rank window instead of
+    // its exact rank: the color's luminance stays within the palette's luminance
+    // span over that window, give or take one bucket (256 / 2^keyBits levels).
+    // Bucket tables are the only extra memory besides the palette.
+    static constexpr int kDefaultKeyBits = 16;
+    Palette ExtractBucketedPalette(int keyBits = kDefaultKeyBits) const;
+    void TransferByHistogram(const Palette& palette, int keyBits = kDefaultKeyBits);
+    void ApplyUpdatedPixels();
+    void CountUniqueColors();
+    size_t UniqueColors(unsigned threads = 0) const;
+
+    void SetSortMode(SortMode mode) { sortMode = mode; }
+    void SetSaveMode(SaveMode mode) { saveMode = mode; }
+    void SetSortThreads(unsigned threads) { sortThreads = threads; } // 0 = all cores
+    // Read and Import compute each row's luminance keys right after the row lands,
+    // while it is still in cache, and the sort or bucketing reuses them. Turning it
+    // off drops the 4 bytes per pixel this costs until the keys are consumed.
+    void SetIngestKeys(bool enabled) { ingestKeys = enabled; }
+
+    static bool ReadHeader(std::istream& input, std::string& version, int& width, int& height);
+
+    int GetWidth() const { return width; }
+    int GetHeight() const { return height; }
+    size_t GetPixelCount() const { return static_cast<size_t>(width) * height; }
+
+private:
+    int width = 0, height = 0;
+    size_t stride = 0; // pixels per row in imageData
+    std::string version = "P6";
+    SortMode sortMode = SortMode::Radix;
+    SaveMode saveMode = SaveMode::Auto;
+    unsigned sortThreads = 0;
+    bool ingestKeys = true;
+    std::vector<RGB, AlignedAllocator<RGB>> imageData; // row-major, row y starts at y * stride
+    std::vector<std::uint32_t> sortedIndices; // imageData indices in ascending luminance order
+    std::vector<std::uint32_t> luminanceKeys; // keys computed on ingest, same layout as imageData; empty when stale
+    std::vector<RGB, AlignedAllocator<RGB>> updatedPixels; // UpdatePixels result when recoloring from itself, same layout as imageData
+
+    // Luminance is never negative, so its IEEE bit pattern orders exactly like the float
+    struct SortKey {
+        std::uint32_t key;
+        std::uint32_t index;
+    };
+
+    void AllocateImage();
+    void ComputeKeys(int firstRow, int lastRow);
+    bool HasKeys() const { return !luminanceKeys.empty() && luminanceKeys.size() == imageData.size(); }
+    std::string Header() const;
+    bool SaveParallel(const std::string& filename, bool mapped) const;
+    static void RadixSort(std::vector<SortKey>& keys, unsigned threads);
+    unsigned SortThreadCount() const;
+    RGB* PrepareUpdate(size_t count);
+    std::vector<std::vector<size_t>> BucketOffsets(unsigned slices, int keyBits) const;
+    template <typename F>
+    void VisitBuckets(unsigned slice, unsigned slices, int keyBits, F&& visit) const;
+
+    // floor(luminance * 2^keyBits / 256); both scalings are exact, so this never
+    // reorders pixels, it only merges neighbours into one bucket
+    static std::uint32_t Bucket(std::uint32_t key, int keyBits) {
+        float scaled = std::bit_cast<float>(key) * static_cast<float>(1u << keyBits) / 256.0f;
+        return std::min(static_cast<std::uint32_t>(scaled), (1u << keyBits) - 1);
+    }
+
+    // Maps rank i of count target pixels onto sourceCount source ranks. Indices
+    // are 32-bit, so the product can't overflow 64 bits.
+    static size_t ScaleRank(size_t i, size_t sourceCount, size_t count) {
+        return sourceCount == count ? i : static_cast<size_t>(std::uint64_t(i) * sourceCount / count);
+    }
+    RGB* Row(int y) { return imageData.data() + y * stride; }
+    const RGB* Row(int y) const { return imageData.data() + y * stride; }
+};
+
+std::string PPMImage::Header() const {
+    return version + "\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+}
+
+void PPMImage::Save(const std::string& filename) {
+    size_t payload = static_cast<size_t>(width) * height * sizeof(RGB);
+    if (version == "P6") {
+        bool large = payload >= kParallelSaveBytes;
+        if (saveMode == SaveMode::Mapped && SaveParallel(filename, true)) return;
+        if ((saveMode == SaveMode::Parallel || (saveMode == SaveMode::Auto && large)) &&
+            SaveParallel(filename, false)) return;
+    }
+
+    std::ofstream output(filename, std::ios::binary);
+    if (!output) return;
+
+    output << Header();
+    if (version == "P6") {
+        if (stride == static_cast<size_t>(width)) {
+            output.write(reinterpret_cast<const char*>(imageData.data()), payload);
+        } else {
+            for (int i = 0; i < height; ++i) {
+                output.write(reinterpret_cast<const char*>(Row(i)), static_cast<std::streamsize>(width) * sizeof(RGB));
+            }
+        }
+    }
+    output.close();
+}
+
+// Sizes the file up front, then each thread writes its own band of rows at
+// its final offset, either with pwrite or by copying into a shared mapping.
+// Returns false when the platform or file system can't do it.
+bool PPMImage::SaveParallel(const std::string& filename, bool mapped) const {
+#ifdef IMAGEREADER_POSIX
+    std::string header = Header();
+    size_t rowBytes = static_cast<size_t>(width) * sizeof(RGB);
+    size_t total = header.size() + rowBytes * height;
+
+    int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    if (ftruncate(fd, static_cast<off_t>(total)) != 0) {
+        close(fd);
+        return false;
+    }
+
+    unsigned char* target = nullptr;
+    if (mapped) {
+        void* mapping = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapping == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        target = static_cast<unsigned char*>(mapping);
+    }
+
+    // Writes [data, data + size) at offset, retrying short writes
+    auto writeAt = [fd, target](const void* data, size_t size, size_t offset) {
+        if (target) {
+            std::copy_n(static_cast<const unsigned char*>(data), size, target + offset);
+            return true;
+        }
+        const char* bytes = static_cast<const char*>(data);
+        while (size > 0) {
+            ssize_t written = pwrite(fd, bytes, size, static_cast<off_t>(offset));
+            if (written <= 0) return false;
+            bytes += written;
+            offset += static_cast<size_t>(written);
+            size -= static_cast<size_t>(written);
+        }
+        return true;
+    };
+
+    bool ok = writeAt(header.data(), header.size(), 0);
+
+    unsigned bands = std::min(std::clamp(ThreadPool::Instance().Size(), 1u, 16u), static_cast<unsigned>(std::max(height, 1)));
+    std::vector<char> bandOk(bands, 0);
+    ParallelFor(bands, [&](unsigned band) {
+        int first = static_cast<int>(static_cast<long long>(height) * band / bands);
+        int last = static_cast<int>(static_cast<long long>(height) * (band + 1) / bands);
+        if (stride == static_cast<size_t>(width)) {
+            bandOk[band] = writeAt(Row(first), rowBytes * (last - first), header.size() + rowBytes * first);
+            return;
+        }
+        bandOk[band] = 1;
+        for (int i = first; i < last && bandOk[band]; ++i) {
+            bandOk[band] = writeAt(Row(i), rowBytes, header.size() + rowBytes * i);
+        }
+    });
+    ok = ok && std::all_of(bandOk.begin(), bandOk.end(), [](char band) { return band != 0; });
+
+    if (target) munmap(target, total);
+    close(fd);
+    return ok;
+#else
+    (void)filename;
+    (void)mapped;
+    return false;
+#endif
+}
+
+// Planar copy of imageData in the layout CImg expects
+CImg<unsigned char> PPMImage::ToCImg() const {
+    CImg<unsigned char> image(width, height, 1, 3);
+    for (int i = 0; i < height; ++i) {
+        const RGB* row = Row(i);
+        unsigned char* r = image.data(0, i, 0, 0);
+        unsigned char* g = image.data(0, i, 0, 1);
+        unsigned char* b = image.data(0, i, 0, 2);
+        for (int j = 0; j < width; ++j) {
+            r[j] = row[j].r;
+            g[j] = row[j].g;
+            b[j] = row[j].b;
+        }
+    }
+    return image;
+}
+
+// A packed RGB row already is an 8-bit RGB PNG scanline, so with libpng the
+// rows go to the encoder straight from imageData; the header and filter
+// settings are the ones CImg uses, so the file is the same either way.
+// Without libpng CImg's own save_png does the work from a planar copy.
+void PPMImage::SavePNG(const std::string& filename) const {
+#ifdef cimg_use_png
+    if (width == 0 || height == 0) {
+        ToCImg().save_png(filename.c_str());
+        return;
+    }
+
+    std::FILE* file = std::fopen(filename.c_str(), "wb");
+    if (!file) throw std::runtime_error("Could not create '" + filename + "'");
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    png_infop info = png ? png_create_info_struct(png) : nullptr;
+    if (!info || setjmp(png_jmpbuf(png))) {
+        png_destroy_write_struct(&png, info ? &info : nullptr);
+        std::fclose(file);
+        throw std::runtime_error("Could not encode '" + filename + "'");
+    }
+
+    png_init_io(png, file);
+    png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+    for (int i = 0; i < height; ++i) {
+        png_write_row(png, reinterpret_cast<png_const_bytep>(Row(i)));
+    }
+    png_write_end(png, info);
+    png_destroy_write_struct(&png, &info);
+    if (std::fclose(file) != 0) throw std::runtime_error("Could not write '" + filename + "'");
+#else
+    ToCImg().save_png(filename.c_str());
+#endif
+}
+
+PPMImage::StripReader::StripReader(const std::string& name) : filename(name), stream(name, std::ios::binary) {
+    std::string version;
+    if (!stream || !ReadHeader(stream, version, width, height) || version != "P6") {
+        throw std::runtime_error("'" + filename + "' is not a readable 8-bit P6 PPM (maxval 255)");
+    }
+}
+
+int PPMImage::StripReader::Read(RGB* strip, int rows) {
+    rows = std::clamp(rows, 0, height - nextRow);
+    std::streamsize bytes = static_cast<std::streamsize>(rows) * width * sizeof(RGB);
+    stream.read(reinterpret_cast<char*>(strip), bytes);
+    if (stream.gcount() != bytes) {
+        throw std::runtime_error("'" + filename + "' is truncated");
+    }
+    nextRow += rows;
+    return rows;
+}
+
+PPMImage::StripWriter::StripWriter(const std::string& name, int stripWidth, int stripHeight)
+    : filename(name), stream(name, std::ios::binary), width(stripWidth), height(stripHeight) {
+    if (!stream) throw std::runtime_error("Could not create '" + filename + "'");
+    stream << "P6\n" << width << " " << height << "\n255\n";
+}
+
+void PPMImage::StripWriter::Write(const RGB* strip, int rows) {
+    if (rows < 0 || rows > height - nextRow) {
+        throw std::runtime_error("'" + filename + "': strip runs past the last row");
+    }
+    stream.write(reinterpret_cast<const char*>(strip), static_cast<std::streamsize>(rows) * width * sizeof(RGB));
+    nextRow += rows;
+}
+
+void PPMImage::StripWriter::Close() {
+    if (nextRow != height) {
+        throw std::runtime_error("'" + filename + "': " + std::to_string(nextRow) + " of " +
+                                 std::to_string(height) + " rows written");
+    }
+    stream.close();
+    if (!stream) throw std::runtime_error("Could not write '" + filename + "'");
+}
+
+// Parses "P6 <width> <height> <maxval>" plus the single whitespace byte
+// that precedes the payload. '#' comments between tokens are skipped.
+bool PPMImage::ReadHeader(std::istream& input, std::string& version, int& width, int& height) {
+    auto skipComments = [&input]() {
+        while (input >> std::ws && input.peek() == '#') {
+            input.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        }
+    };
+
+    int maxVal = 0;
+    skipComments();
+    input >> version;
+    skipComments();
+    input >> width;
+    skipComments();
+    input >> height;
+    skipComments();
+    input >> maxVal;
+    input.ignore();
+    // Pixels are packed 8-bit RGB; 16-bit samples (maxval > 255) would be misread
+    return input && width > 0 && height > 0 && maxVal == 255;
+}
+
+// Maps the file and copies the payload out of the page cache in one pass;
+// anything that can't be mapped (pipes, FIFOs) is read with bulk stream reads
+void PPMImage::Read(const std::string& filename) {
+    MappedFile mapped(filename);
+    if (mapped.Data()) {
+        MemoryStreamBuf buffer(mapped.Data(), mapped.Size());
+        std::istream header(&buffer);
+        if (!ReadHeader(header, version, width, height)) return;
+
+        AllocateImage();
+        if (version == "P6") {
+            size_t offset = buffer.Consumed();
+            size_t available = mapped.Size() - std::min(offset, mapped.Size());
+            size_t rowBytes = static_cast<size_t>(width) * sizeof(RGB);
+            ParallelForRange(height, std::max<size_t>(1, kMinPixelsPerTask / width), [&](size_t first, size_t last) {
+                for (size_t i = first; i < last; ++i) {
+                    size_t start = std::min(i * rowBytes, available);
+                    std::copy_n(mapped.Data() + offset + start, std::min(rowBytes, available - start),
+                                reinterpret_cast<unsigned char*>(Row(static_cast<int>(i))));
+                    ComputeKeys(static_cast<int>(i), static_cast<int>(i) + 1);
+                }
+            });
+        }
+        return;
+    }
+
+    std::ifstream input(filename, std::ios::binary);
+    if (!input || !ReadHeader(input, version, width, height)) return;
+    
+    AllocateImage();
+
+    if (version == "P6") {
+        // Strips small enough to still be in cache when their keys are computed;
+        // rows past a truncated payload stay white
+        int stripRows = std::max(1, static_cast<int>(kMinPixelsPerTask / width));
+        for (int first = 0; first < height; first += stripRows) {
+            int rows = std::min(stripRows, height - first);
+            input.read(reinterpret_cast<char*>(Row(first)), static_cast<std::streamsize>(rows) * width * sizeof(RGB));
+            ComputeKeys(first, first + rows);
+        }
+    }
+    input.close();
+}
+
+// Takes interleaved 8-bit samples (r, g, b, r, g, b, ...), row after row
+void PPMImage::Import(const unsigned char* rgb, int newWidth, int newHeight) {
+    width = newWidth;
+    height = newHeight;
+    version = "P6";
+    AllocateImage();
+
+    for (int i = 0; i < height; ++i) {
+        std::copy_n(rgb + static_cast<size_t>(i) * width * 3, static_cast<size_t>(width) * 3,
+                    reinterpret_cast<unsigned char*>(Row(i)));
+        ComputeKeys(i, i + 1);
+    }
+}
+
+// CImg keeps channels planar; interleave them straight into imageData.
+// Gray images (1 or 2 channels) are replicated, alpha is dropped.
+void PPMImage::Import(const CImg<unsigned char>& image) {
+    width = image.width();
+    height = image.height();
+    version = "P6";
+    AllocateImage();
+    if (image.is_empty()) return;
+
+    bool gray = image.spectrum() < 3;
+    ParallelForRange(height, std::max<size_t>(1, kMinPixelsPerTask / width), [&](size_t first, size_t last) {
+        for (int i = static_cast<int>(first); i < static_cast<int>(last); ++i) {
+            const unsigned char* r = image.data(0, i, 0, 0);
+            const unsigned char* g = gray ? r : image.data(0, i, 0, 1);
+            const unsigned char* b = gray ? r : image.data(0, i, 0, 2);
+            RGB* row = Row(i);
+            for (int j = 0; j < width; ++j) {
+                row[j] = {r[j], g[j], b[j]};
+            }
+            ComputeKeys(i, i + 1);
+        }
+    });
+}
+
+void PPMImage::AllocateImage() {
+    stride = width;
+    imageData.assign(static_cast<size_t>(height) * stride, {255, 255, 255});
+    sortedIndices.clear();
+    luminanceKeys.clear();
+    if (ingestKeys) luminanceKeys.resize(imageData.size());
+}
+
+// Fills luminanceKeys for rows [firstRow, lastRow) once their pixels are final
+void PPMImage::ComputeKeys(int firstRow, int lastRow) {
+    if (luminanceKeys.size() != imageData.size()) return;
+    for (int i = firstRow; i < lastRow; ++i) {
+        Luminance::Compute(reinterpret_cast<const unsigned char*>(Row(i)), width, luminanceKeys.data() + i * stride);
+    }
+}
+
+// Nearest neighbour, so every output pixel is a copy of an input pixel and
+// its ingest key is carried along instead of recomputed
+void PPMImage::Resize(int newHeight, int newWidth) {
+    size_t count = static_cast<size_t>(newHeight) * newWidth;
+    std::vector<RGB, AlignedAllocator<RGB>> resized(count);
+    std::vector<std::uint32_t> resizedKeys(HasKeys() ? count : 0);
+    size_t minRows = std::max<size_t>(1, kMinPixelsPerTask / std::max(newWidth, 1));
+    ParallelForRange(newHeight, minRows, [&](size_t first, size_t last) {
+        for (size_t i = first; i < last; ++i) {
+            size_t srcStart = static_cast<size_t>(static_cast<long long>(i) * height / newHeight) * stride;
+            const RGB* srcRow = imageData.data() + srcStart;
+            RGB* dstRow = resized.data() + i * newWidth;
+            for (int j = 0; j < newWidth; ++j) {
+                dstRow[j] = srcRow[static_cast<long long>(j) * width / newWidth];
+            }
+            if (resizedKeys.empty()) continue;
+            const std::uint32_t* srcKeys = luminanceKeys.data() + srcStart;
+            std::uint32_t* dstKeys = resizedKeys.data() + i * newWidth;
+            for (int j = 0; j < newWidth; ++j) {
+                dstKeys[j] = srcKeys[static_cast<long long>(j) * width / newWidth];
+            }
+        }
+    });
+    imageData = std::move(resized);
+    luminanceKeys = std::move(resizedKeys);
+    sortedIndices.clear();
+    height = newHeight;
+    width = newWidth;
+    stride = newWidth;
+}
+
+// Threads worth using for one image: all cores unless limited by
+// SetSortThreads, and never so many that a slice drops below 256K pixels
+unsigned PPMImage::SortThreadCount() const {
+    constexpr size_t kMinPixelsPerThread = size_t(256) << 10;
+    unsigned threads = sortThreads ? sortThreads : ThreadPool::Instance().Size();
+    size_t pixels = static_cast<size_t>(width) * height;
+    return static_cast<unsigned>(std::clamp<size_t>(pixels / kMinPixelsPerThread, 1, threads));
+}
+
+void PPMImage::ComputeLuminanceAndSort() {
+    unsigned threads = SortThreadCount();
+
+    // Keys only live for the duration of the sort; afterwards just the index order is kept.
+    // Keys from ingest are used as they are and released before the sort needs its buffer.
+    bool haveKeys = HasKeys();
+    std::vector<SortKey> keys(static_cast<size_t>(width) * height);
+    ParallelFor(threads, [&](unsigned t) {
+        int first = static_cast<int>(static_cast<long long>(height) * t / threads);
+        int last = static_cast<int>(static_cast<long long>(height) * (t + 1) / threads);
+        std::vector<std::uint32_t> scratch(haveKeys ? 0 : width);
+        for (int i = first; i < last; ++i) {
+            std::uint32_t rowStart = static_cast<std::uint32_t>(i * stride);
+            const std::uint32_t* rowKeys = haveKeys ? luminanceKeys.data() + rowStart : scratch.data();
+            if (!haveKeys) Luminance::Compute(reinterpret_cast<const unsigned char*>(Row(i)), width, scratch.data());
+            SortKey* out = keys.data() + static_cast<size_t>(i) * width;
+            for (int j = 0; j < width; ++j) {
+                out[j] = {rowKeys[j], rowStart + j};
+            }
+        }
+    });
+    luminanceKeys.clear();
+    luminanceKeys.shrink_to_fit();
+    if (sortMode == SortMode::Radix) {
+        RadixSort(keys, threads);
+    } else {
+        std::stable_sort(keys.begin(), keys.end(), [](const SortKey& a, const SortKey& b) {
+            return a.key < b.key;
+        });
+    }
+
+    sortedIndices.resize(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        sortedIndices[i] = keys[i].index;
+    }
+}
+
+// Stable LSD radix sort on the 32-bit key, 11 bits per pass.
+// Passes whose digit is the same for every key are skipped; with 8-bit
+// RGB the exponent bits rarely vary, so this is usually two or three passes.
+// Each thread histograms and scatters its own contiguous slice. Offsets are
+// prefix sums in (digit, slice) order, so slice t's keys land right after
+// slice t-1's keys with the same digit, and the result is the same as the
+// single-threaded sort for any thread count.
+void PPMImage::RadixSort(std::vector<SortKey>& keys, unsigned threads) {
+    constexpr int kDigitBits = 11;
+    constexpr std::uint32_t kBuckets = 1u << kDigitBits;
+    constexpr std::uint32_t kMask = kBuckets - 1;
+
+    size_t n = keys.size();
+    if (n == 0) return;
+    threads = std::max(1u, threads);
+
+    std::vector<SortKey> buffer(n);
+    std::vector<std::array<size_t, kBuckets>> offsets(threads);
+    for (int shift = 0; shift < 32; shift += kDigitBits) {
+        ParallelFor(threads, [&](unsigned t) {
+            auto& histogram = offsets[t];
+            histogram.fill(0);
+            for (size_t i = n * t / threads, last = n * (t + 1) / threads; i < last; ++i) {
+                ++histogram[(keys[i].key >> shift) & kMask];
+            }
+        });
+
+        std::uint32_t firstDigit = (keys[0].key >> shift) & kMask;
+        size_t firstDigitCount = 0;
+        for (const auto& histogram : offsets) {
+            firstDigitCount += histogram[firstDigit];
+        }
+        if (firstDigitCount == n) continue;
+
+        size_t sum = 0;
+        for (std::uint32_t digit = 0; digit < kBuckets; ++digit) {
+            for (auto& histogram : offsets) {
+                size_t count = histogram[digit];
+                histogram[digit] = sum;
+                sum += count;
+            }
+        }
+
+        ParallelFor(threads, [&](unsigned t) {
+            auto& offset = offsets[t];
+            for (size_t i = n * t / threads, last = n * (t + 1) / threads; i < last; ++i) {
+                buffer[offset[(keys[i].key >> shift) & kMask]++] = keys[i];
+            }
+        });
+        keys.swap(buffer);
+    }
+}
+
+void PPMImage::UpdatePixels(PPMImage* source, PPMImage* target) {
+    if (!source || !target || target->imageData.size() != imageData.size()) return;
+
+    // Rank i of the target takes the color of source rank floor(i * sourceCount / count)
+    // (rank i itself when both have the same size), so the transfer is a plain gather
+    // from source->imageData and scatter into imageData. Only when the source is this
+    // image, and still being read, does the result go through updatedPixels.
+    size_t sourceCount = source->sortedIndices.size();
+    size_t count = target->sortedIndices.size();
+    if (sourceCount == 0 || count == 0) return;
+
+    const RGB* srcData = source->imageData.data();
+    const std::uint32_t* srcOrder = source->sortedIndices.data();
+    const std::uint32_t* tgtOrder = target->sortedIndices.data();
+    RGB* dst = source == this ? PrepareUpdate(count) : imageData.data();
+    luminanceKeys.clear();
+    // Ranks map to distinct pixels, so the rank ranges can be scattered concurrently
+    ParallelForRange(count, kMinPixelsPerTask, [&](size_t first, size_t last) {
+        for (size_t i = first; i < last; ++i) {
+            dst[tgtOrder[i]] = srcData[srcOrder[ScaleRank(i, sourceCount, count)]];
+        }
+    });
+}
+
+// Same transfer as above with the source's ranked colors already gathered,
+// always straight into imageData
+void PPMImage::UpdatePixels(const Palette& palette) {
+    std::span<const RGB> ranked = palette.Colors();
+    size_t count = sortedIndices.size();
+    if (ranked.empty() || count == 0) return;
+    luminanceKeys.clear();
+
+    const RGB* colors = ranked.data();
+    const std::uint32_t* order = sortedIndices.data();
+    RGB* dst = imageData.data();
+    ParallelForRange(count, kMinPixelsPerTask, [&](size_t first, size_t last) {
+        for (size_t i = first; i < last; ++i) {
+            dst[order[i]] = colors[ScaleRank(i, ranked.size(), count)];
+        }
+    });
+}
+
+PPMImage::RGB* PPMImage::PrepareUpdate(size_t count) {
+    if (count < imageData.size()) {
+        updatedPixels = imageData; // pixels without a counterpart keep their color
+    } else {
+        updatedPixels.resize(imageData.size());
+    }
+    return updatedPixels.data();
+}
+
+// Needs ComputeLuminanceAndSort first
+PPMImage::Palette PPMImage::ExtractPalette() const {
+    Palette palette;
+    palette.width = width;
+    palette.height = height;
+    palette.colors.resize(sortedIndices.size());
+    ParallelForRange(sortedIndices.size(), kMinPixelsPerTask, [&](size_t first, size_t last) {
+        for (size_t i = first; i < last; ++i) {
+            palette.colors[i] = imageData[sortedIndices[i]];
+        }
+    });
+    return palette;
+}
+
+// Palette index file, version 1. All integers little-endian.
+//   0  char[8]  "IRPALIDX"
+//   8  uint32   format version
+//  12  uint32   ranking: 0 = exact luminance sort, 8..16 = histogram key bits
+//  16  int32    width of the source image
+//  20  int32    height of the source image
+//  24  uint64   color count
+//  32  count * 3 bytes of r, g, b in ascending luminance order
+namespace PaletteIndex {
+constexpr char kMagic[8] = {'I', 'R', 'P', 'A', 'L', 'I', 'D', 'X'};
+constexpr std::uint32_t kVersion = 1;
+constexpr size_t kHeaderSize = 32;
+
+inline void Put(unsigned char* out, std::uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; ++i) {
+        out[i] = static_cast<unsigned char>(value >> (8 * i));
+    }
+}
+
+inline std::uint64_t Get(const unsigned char* in, int bytes) {
+    std::uint64_t value = 0;
+    for (int i = 0; i < bytes; ++i) {
+        value |= std::uint64_t(in[i]) << (8 * i);
+    }
+    return value;
+}
+} // namespace PaletteIndex
+
+std::span<const PPMImage::RGB> PPMImage::Palette::Colors() const {
+    if (mapping) {
+        const RGB* data = reinterpret_cast<const RGB*>(mapping->Data() + PaletteIndex::kHeaderSize);
+        return {data, static_cast<size_t>(PaletteIndex::Get(mapping->Data() + 24, 8))};
+    }
+    return colors;
+}
+
+void PPMImage::Palette::Save(const std::string& filename) const {
+    std::span<const RGB> ranked = Colors();
+    unsigned char header[PaletteIndex::kHeaderSize] = {};
+    std::memcpy(header, PaletteIndex::kMagic, sizeof(PaletteIndex::kMagic));
+    PaletteIndex::Put(header + 8, PaletteIndex::kVersion, 4);
+    PaletteIndex::Put(header + 12, static_cast<std::uint32_t>(keyBits), 4);
+    PaletteIndex::Put(header + 16, static_cast<std::uint32_t>(width), 4);
+    PaletteIndex::Put(header + 20, static_cast<std::uint32_t>(height), 4);
+    PaletteIndex::Put(header + 24, ranked.size(), 8);
+
+    std::ofstream output(filename, std::ios::binary);
+    output.write(reinterpret_cast<const char*>(header), sizeof(header));
+    output.write(reinterpret_cast<const char*>(ranked.data()), static_cast<std::streamsize>(ranked.size() * sizeof(RGB)));
+    if (!output) throw std::runtime_error("Could not write palette index '" + filename + "'");
+}
+
+bool PPMImage::Palette::IsIndexFile(const std::string& filename) {
+    char magic[sizeof(PaletteIndex::kMagic)] = {};
+    std::ifstream input(filename, std::ios::binary);
+    return input.read(magic, sizeof(magic)) && std::memcmp(magic, PaletteIndex::kMagic, sizeof(magic)) == 0;
+}
+
+// Maps the file; the colors are served straight from the page cache. Falls
+// back to reading it into memory where it can't be mapped.
+PPMImage::Palette PPMImage::Palette::Load(const std::string& filename) {
+    auto mapped = std::make_shared<const MappedFile>(filename);
+    std::vector<unsigned char> buffer;
+    const unsigned char* data = mapped->Data();
+    size_t size = mapped->Size();
+    if (!data) {
+        std::ifstream input(filename, std::ios::binary);
+        if (!input) throw std::runtime_error("Could not open palette index '" + filename + "'");
+        buffer.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+        data = buffer.data();
+        size = buffer.size();
+    }
+
+    if (size < PaletteIndex::kHeaderSize || std::memcmp(data, PaletteIndex::kMagic, sizeof(PaletteIndex::kMagic)) != 0) {
+        throw std::runtime_error("'" + filename + "' is not a palette index");
+    }
+    std::uint32_t version = static_cast<std::uint32_t>(PaletteIndex::Get(data + 8, 4));
+    if (version != PaletteIndex::kVersion) {
+        throw std::runtime_error("Palette index '" + filename + "' has unsupported version " + std::to_string(version));
+    }
+    std::uint32_t keyBits = static_cast<std::uint32_t>(PaletteIndex::Get(data + 12, 4));
+    if (keyBits != 0 && (keyBits < 8 || keyBits > 16)) {
+        throw std::runtime_error("Palette index '" + filename + "' has unknown ranking " + std::to_string(keyBits));
+    }
+    std::uint64_t count = PaletteIndex::Get(data + 24, 8);
+    if (count > (size - PaletteIndex::kHeaderSize) / sizeof(RGB)) {
+        throw std::runtime_error("Palette index '" + filename + "' is truncated");
+    }
+    // --batch resizes base images to width x height, which must hold exactly one pixel per color
+    std::int32_t width = static_cast<std::int32_t>(PaletteIndex::Get(data + 16, 4));
+    std::int32_t height = static_cast<std::int32_t>(PaletteIndex::Get(data + 20, 4));
+    if (width <= 0 || height <= 0 || static_cast<std::uint64_t>(width) * static_cast<std::uint64_t>(height) != count) {
+        throw std::runtime_error("Palette index '" + filename + "' is corrupt: " + std::to_string(width) + "x" +
+                                 std::to_string(height) + " doesn't match its " + std::to_string(count) + " colors");
+    }
+
+    Palette palette;
+    palette.keyBits = static_cast<int>(keyBits);
+    palette.width = width;
+    palette.height = height;
+    if (mapped->Data()) {
+        palette.mapping = std::move(mapped);
+    } else {
+        const RGB* colors = reinterpret_cast<const RGB*>(data + PaletteIndex::kHeaderSize);
+        palette.colors.assign(colors, colors + count);
+    }
+    return palette;
+}
+
+// Calls visit(index, bucket) for every pixel of row band `slice`, in raster order
+template <typename F>
+void PPMImage::VisitBuckets(unsigned slice, unsigned slices, int keyBits, F&& visit) const {
+    int first = static_cast<int>(static_cast<long long>(height) * slice / slices);
+    int last = static_cast<int>(static_cast<long long>(height) * (slice + 1) / slices);
+    bool haveKeys = HasKeys();
+    std::vector<std::uint32_t> scratch(haveKeys ? 0 : width);
+    for (int i = first; i < last; ++i) {
+        size_t rowStart = i * stride;
+        const std::uint32_t* rowKeys = haveKeys ? luminanceKeys.data() + rowStart : scratch.data();
+        if (!haveKeys) Luminance::Compute(reinterpret_cast<const unsigned char*>(Row(i)), width, scratch.data());
+        for (int j = 0; j < width; ++j) {
+            visit(rowStart + j, Bucket(rowKeys[j], keyBits));
+        }
+    }
+}
+
+// Per-band bucket counts turned into start offsets in (bucket, band) order, so
+// band t's pixels in a bucket follow band t-1's and the result is independent
+// of the band count
+std::vector<std::vector<size_t>> PPMImage::BucketOffsets(unsigned slices, int keyBits) const {
+    size_t buckets = size_t(1) << keyBits;
+    std::vector<std::vector<size_t>> offsets(slices, std::vector<size_t>(buckets));
+    ParallelFor(slices, [&](unsigned t) {
+        auto& histogram = offsets[t];
+        VisitBuckets(t, slices, keyBits, [&histogram](size_t, std::uint32_t bucket) { ++histogram[bucket]; });
+    });
+
+    size_t sum = 0;
+    for (size_t bucket = 0; bucket < buckets; ++bucket) {
+        for (auto& histogram : offsets) {
+            size_t count = histogram[bucket];
+            histogram[bucket] = sum;
+            sum += count;
+        }
+    }
+    return offsets;
+}
+
+PPMImage::Palette PPMImage::ExtractBucketedPalette(int keyBits) const {
+    keyBits = std::clamp(keyBits, 8, 16);
+    unsigned slices = std::min(SortThreadCount(), static_cast<unsigned>(std::max(height, 1)));
+    auto offsets = BucketOffsets(slices, keyBits);
 
-// Progress bar function
-void ShowProgressBar(const std::string& taskName, int progress, int total) {
-    int barWidth = 50; // Width of the progress bar
-    float percentage = static_cast<float>(progress) / total;
-    int pos = static_cast<int>(barWidth * percentage);
+    Palette palette;
+    palette.width = width;
+    palette.height = height;
+    palette.keyBits = keyBits;
+    palette.colors.resize(static_cast<size_t>(width) * height);
+    ParallelFor(slices, [&](unsigned t) {
+        auto& cursor = offsets[t];
+        VisitBuckets(t, slices, keyBits, [&](size_t index, std::uint32_t bucket) {
+            palette.colors[cursor[bucket]++] = imageData[index];
+        });
+    });
+    return palette;
+}
 
-    std::cout << "\r" << taskName << " [";
-    for (int i = 0; i < barWidth; ++i) {
-        if (i < pos) std::cout << "=";
-        else if (i == pos) std::cout << ">";
-        else std::cout << " ";
+// Recolors imageData in place; a pixel's bucket is computed from its original
+// color right before the same thread overwrites it
+void PPMImage::TransferByHistogram(const Palette& palette, int keyBits) {
+    std::span<const RGB> ranked = palette.Colors();
+    size_t count = imageData.size();
+    if (ranked.empty() || count == 0) return;
+
+    keyBits = std::clamp(keyBits, 8, 16);
+    unsigned slices = std::min(SortThreadCount(), static_cast<unsigned>(std::max(height, 1)));
+    auto offsets = BucketOffsets(slices, keyBits);
+    ParallelFor(slices, [&](unsigned t) {
+        auto& cursor = offsets[t];
+        VisitBuckets(t, slices, keyBits, [&](size_t index, std::uint32_t bucket) {
+            imageData[index] = ranked[ScaleRank(cursor[bucket]++, ranked.size(), count)];
+        });
+    });
+    luminanceKeys.clear();
+    luminanceKeys.shrink_to_fit();
+}
+
+// Only has work to do after an image was recolored from itself; every other
+// transfer already wrote its result into imageData
+void PPMImage::ApplyUpdatedPixels() {
+    if (updatedPixels.size() != imageData.size()) return;
+
+    imageData.swap(updatedPixels);
+    updatedPixels.clear();
+    updatedPixels.shrink_to_fit();
+    luminanceKeys.clear();
+    luminanceKeys.shrink_to_fit();
+}
+
+void PPMImage::CountUniqueColors() {
+    std::cout << "Unique colors: " << UniqueColors() << std::endl;
+}
+
+// One presence bit per 24-bit color (2 MB), then a popcount. With several
+// threads each marks its own bitmap for a slice of the image and the bitmaps
+// are OR-merged. threads == 0 picks a count from the image size.
+size_t PPMImage::UniqueColors(unsigned threads) const {
+    constexpr size_t kWords = (size_t(1) << 24) / 64;
+    constexpr size_t kPixelsPerThread = size_t(4) << 20; // below this a second bitmap costs more than it saves
+
+    size_t count = imageData.size();
+    if (threads == 0) {
+        threads = ThreadPool::Instance().TasksFor(count, kPixelsPerThread);
     }
-    std::cout << "] " << int(percentage * 100.0) << "%";
-    std::cout.flush();
-    if (progress == total) std::cout << std::endl;
+
+    auto mark = [this](size_t first, size_t last, std::uint64_t* bitmap) {
+        const RGB* pixels = imageData.data();
+        for (size_t i = first; i < last; ++i) {
+            std::uint32_t color = (std::uint32_t(pixels[i].r) << 16) | (std::uint32_t(pixels[i].g) << 8) | pixels[i].b;
+            bitmap[color >> 6] |= std::uint64_t(1) << (color & 63);
+        }
+    };
+
+    std::vector<std::vector<std::uint64_t>> bitmaps(threads, std::vector<std::uint64_t>(kWords));
+    ParallelFor(threads, [&](unsigned t) {
+        mark(count * t / threads, count * (t + 1) / threads, bitmaps[t].data());
+    });
+
+    size_t unique = 0;
+    std::uint64_t* merged = bitmaps[0].data();
+    for (size_t w = 0; w < kWords; ++w) {
+        for (unsigned t = 1; t < threads; ++t) {
+            merged[w] |= bitmaps[t][w];
+        }
+        unique += std::popcount(merged[w]);
+    }
+    return unique;
 }
 
-class PPMImage {
+// Out-of-core transfer for PPMs that don't fit in memory. Peak memory stays
+// near options.memoryBudget; everything else lives in temporary files:
+//  1. Both inputs are read in strips of rows; each strip's (luminance key, payload)
+//     records are radix sorted and spilled as a run. The payload is the packed
+//     color for the palette image and the pixel index for the base image.
+//  2. The palette runs and the base runs are k-way merged in lockstep. Ties go
+//     to the earlier run, so both orders equal a stable sort of the whole image.
+//     Base rank i takes palette rank floor(i * palette pixels / base pixels), as
+//     with --keep-size, and the (index, color) pair is appended to the partition
+//     file of the group of output strips that holds the index.
+//  3. Each group is split into smaller groups until it is down to one strip,
+//     which is filled from its partition file and written out in order.
+// No pass has more than FanIn() files open: runs beyond that are first merged
+// in passes of consecutive runs (which keeps ties in run order), and strips are
+// grouped as above. The fan-in is capped by the open file limit and by the
+// budget, so every open stream still gets a reasonable buffer. Freed heap is
+// handed back to the OS between phases so one phase's buffers don't sit on
+// top of the next one's.
+// The result is byte-identical to the in-memory sort mode with --keep-size.
+class ExternalTransfer {
 public:
-    struct RGB {
-        unsigned char r, g, b;
-        float luminance;
-        int x, y;
+    struct Options {
+        size_t memoryBudget = size_t(1) << 30;
+        fs::path tempDir; // empty = system temp directory
     };
 
-    ~PPMImage() = default;
-    PPMImage() = default;
-    
-    void Save(const std::string& filename);
-    void Read(const std::string& filename);
-    void Resize(int newHeight, int newWidth);
-    void ComputeLuminanceAndSort();
-    void UpdatePixels(PPMImage* source, PPMImage* target);
-    void ApplyUpdatedPixels();
-    void CountUniqueColors();
+    explicit ExternalTransfer(Options transferOptions) : options(std::move(transferOptions)) {
+        options.memoryBudget = std::max(options.memoryBudget, kMinBudget);
+        if (options.tempDir.empty()) options.tempDir = fs::temp_directory_path();
+    }
+    ~ExternalTransfer() {
+        std::error_code ignored;
+        for (const auto& file : tempFiles) {
+            fs::remove(file, ignored);
+        }
+    }
+    ExternalTransfer(const ExternalTransfer&) = delete;
+    ExternalTransfer& operator=(const ExternalTransfer&) = delete;
 
-    int GetWidth() const { return width; }
-    int GetHeight() const { return height; }
+    void Run(const std::string& sourceFile, const std::string& targetFile, const std::string& outputFile);
 
 private:
-    int width = 0, height = 0;
-    std::string version = "P6";
-    std::vector<std::vector<RGB>> imageData;
-    std::vector<RGB> sortedPixels;
-    std::map<std::pair<int, int>, RGB> pixelMap;
+    using RGB = PPMImage::RGB;
+    using Record = PPMImage::SortKey;
+    using Input = PPMImage::StripReader;
+    static constexpr size_t kMinBudget = size_t(1) << 20;
+    static constexpr size_t kMinBufferRecords = 4096;
+    static constexpr size_t kMaxFanIn = 256;
+    static constexpr size_t kReservedFiles = 16; // stdio, inputs, output and some slack
 
-    void AllocateImage();
-};
+    // Where a merged base pixel goes: its index in the output and its new color
+    struct StripRecord {
+        std::uint32_t index;
+        std::uint32_t color;
+    };
 
-void PPMImage::Save(const std::string& filename) {
-    std::ofstream output(filename, std::ios::binary);
-    if (!output) return;
+    // Buffered sequential access to a file of fixed-size records
+    template <typename T>
+    class RecordReader {
+    public:
+        // The buffer never grows past the file itself
+        RecordReader(const fs::path& file, size_t bufferRecords) : stream(file, std::ios::binary) {
+            if (!stream) throw std::runtime_error("Could not open temporary file " + file.string());
+            size_t records = static_cast<size_t>(fs::file_size(file)) / sizeof(T);
+            buffer.resize(std::clamp<size_t>(bufferRecords, 1, std::max<size_t>(records, 1)));
+        }
+        bool Next(T& record) {
+            if (position == available) {
+                stream.read(reinterpret_cast<char*>(buffer.data()), static_cast<std::streamsize>(buffer.size() * sizeof(T)));
+                available = static_cast<size_t>(stream.gcount()) / sizeof(T);
+                position = 0;
+                if (available == 0) return false;
+            }
+            record = buffer[position++];
+            return true;
+        }
 
-    output << version << "\n" << width << " " << height << "\n255\n";
-    if (version == "P6") {
-        for (const auto& row : imageData) {
-            for (const auto& pixel : row) {
-                output.write(reinterpret_cast<const char*>(&pixel), 3);
+    private:
+        std::ifstream stream;
+        std::vector<T> buffer;
+        size_t position = 0, available = 0;
+    };
+
+    template <typename T>
+    class RecordWriter {
+    public:
+        RecordWriter(const fs::path& file, size_t bufferRecords) : stream(file, std::ios::binary) {
+            if (!stream) throw std::runtime_error("Could not create temporary file " + file.string());
+            buffer.reserve(std::max(bufferRecords, size_t(1)));
+        }
+        void Push(const T& record) {
+            buffer.push_back(record);
+            if (buffer.size() == buffer.capacity()) Flush();
+        }
+        void Write(const T* records, size_t count) {
+            Flush();
+            stream.write(reinterpret_cast<const char*>(records), static_cast<std::streamsize>(count * sizeof(T)));
+        }
+        void Flush() {
+            stream.write(reinterpret_cast<const char*>(buffer.data()), static_cast<std::streamsize>(buffer.size() * sizeof(T)));
+            buffer.clear();
+            if (!stream) throw std::runtime_error("Could not write temporary file (disk full?)");
+        }
+
+    private:
+        std::ofstream stream;
+        std::vector<T> buffer;
+    };
+
+    // Merges sorted runs; equal keys come out in run order
+    class RunMerger {
+    public:
+        RunMerger(const std::vector<fs::path>& runs, size_t bufferRecords) {
+            for (size_t run = 0; run < runs.size(); ++run) {
+                readers.push_back(std::make_unique<RecordReader<Record>>(runs[run], bufferRecords));
+                heads.emplace_back();
+                if (readers[run]->Next(heads[run])) queue.push({heads[run].key, run});
             }
         }
+        bool Next(Record& record) {
+            if (queue.empty()) return false;
+            size_t run = queue.top().second;
+            queue.pop();
+            record = heads[run];
+            if (readers[run]->Next(heads[run])) queue.push({heads[run].key, run});
+            return true;
+        }
+
+    private:
+        using Entry = std::pair<std::uint32_t, size_t>; // key, run
+        std::vector<std::unique_ptr<RecordReader<Record>>> readers;
+        std::vector<Record> heads;
+        std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> queue;
+    };
+
+    Options options;
+    std::vector<fs::path> tempFiles;
+
+    static std::uint32_t PackColor(const RGB& color) {
+        return std::uint32_t(color.r) | (std::uint32_t(color.g) << 8) | (std::uint32_t(color.b) << 16);
     }
-    output.close();
+    static RGB UnpackColor(std::uint32_t packed) {
+        return {static_cast<unsigned char>(packed), static_cast<unsigned char>(packed >> 8), static_cast<unsigned char>(packed >> 16)};
+    }
+
+    fs::path TempFile(const std::string& tag) {
+        static std::atomic<unsigned> counter{0};
+        fs::path file = options.tempDir / ("imagereader-" + std::to_string(
+#ifdef IMAGEREADER_POSIX
+            getpid()
+#else
+            0
+#endif
+            ) + "-" + std::to_string(counter++) + "-" + tag + ".tmp");
+        tempFiles.push_back(file);
+        return file;
+    }
+
+    static void CheckAddressable(const Input& input, const std::string& filename) {
+        if (input.Pixels() > std::numeric_limits<std::uint32_t>::max()) {
+            throw std::runtime_error("'" + filename + "' has more pixels than 32-bit indices can address");
+        }
+    }
+
+    // Output pixels [first, first + count), in a file of StripRecords
+    struct Partition {
+        fs::path file;
+        size_t first, count;
+    };
+
+    size_t fanIn = 2;
+
+    size_t FanIn() const;
+    static void ReleaseFreedMemory();
+    std::vector<fs::path> WriteSortedRuns(Input& input, bool colorPayload, const std::string& tag);
+    std::vector<fs::path> ReduceRuns(std::vector<fs::path> runs, size_t limit, const std::string& tag);
+    std::vector<Partition> Split(const Partition& partition, size_t stripPixels);
+    std::vector<Partition> SplitIntoStrips(const std::vector<Partition>& groups, size_t stripPixels);
+};
+
+// Files one pass may keep open. Every merge input and partition writer needs
+// a buffer of at least kMinBufferRecords, and a final merge has up to two
+// fan-ins of streams open (runs plus partition writers). The soft open file
+// limit is raised towards the hard one when it is too low for kMaxFanIn.
+size_t ExternalTransfer::FanIn() const {
+    size_t byBudget = options.memoryBudget / (2 * kMinBufferRecords * sizeof(Record));
+    size_t fanIn = std::min(kMaxFanIn, byBudget);
+#ifdef IMAGEREADER_POSIX
+    rlimit limit{};
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        rlim_t wanted = static_cast<rlim_t>(2 * kMaxFanIn + kReservedFiles);
+        if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < wanted) {
+            rlimit raised = limit;
+            raised.rlim_cur = limit.rlim_max == RLIM_INFINITY ? wanted : std::min(wanted, limit.rlim_max);
+            if (setrlimit(RLIMIT_NOFILE, &raised) == 0) limit = raised;
+        }
+        if (limit.rlim_cur != RLIM_INFINITY) {
+            size_t files = static_cast<size_t>(limit.rlim_cur);
+            if (files < 2 * 2 + kReservedFiles) {
+                throw std::runtime_error("The open file limit (ulimit -n) is " + std::to_string(files) +
+                                         "; the external sort needs at least " + std::to_string(2 * 2 + kReservedFiles));
+            }
+            fanIn = std::min(fanIn, (files - kReservedFiles) / 2);
+        }
+    }
+#endif
+    return std::max<size_t>(fanIn, 2);
 }
 
-void PPMImage::Read(const std::string& filename) {
-    std::ifstream input(filename, std::ios::binary);
-    if (!input) return;
-    
-    input >> version >> width >> height;
-    int maxVal;
-    input >> maxVal;
-    input.ignore();
-    
-    AllocateImage();
+// Returns the heap the last phase freed to the OS; glibc otherwise keeps it
+// mapped, and the next phase's buffers would count on top of it
+void ExternalTransfer::ReleaseFreedMemory() {
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+}
 
-    if (version == "P6") {
-        for (auto& row : imageData) {
-            for (auto& pixel : row) {
-                input.read(reinterpret_cast<char*>(&pixel), 3);
+// A chunk costs 3 bytes of pixels plus 8 + 8 bytes of records and radix
+// buffer per pixel, so the budget buys budget / 19 pixels per run
+std::vector<fs::path> ExternalTransfer::WriteSortedRuns(Input& input, bool colorPayload, const std::string& tag) {
+    constexpr size_t kKeyBlock = 4096;
+    int chunkRows = static_cast<int>(std::clamp<size_t>(options.memoryBudget / 19 / input.Width(), 1, input.Height()));
+    size_t chunkPixels = static_cast<size_t>(chunkRows) * input.Width();
+    unsigned threads = ThreadPool::Instance().TasksFor(chunkPixels, PPMImage::kMinPixelsPerTask);
+
+    std::vector<RGB> pixels(chunkPixels);
+    std::vector<Record> records;
+    std::vector<fs::path> runs;
+    for (int rows; (rows = input.Read(pixels.data(), chunkRows)) > 0;) {
+        size_t start = static_cast<size_t>(input.NextRow() - rows) * input.Width();
+        size_t count = static_cast<size_t>(rows) * input.Width();
+
+        records.resize(count);
+        std::uint32_t keys[kKeyBlock];
+        for (size_t block = 0; block < count; block += kKeyBlock) {
+            size_t n = std::min(kKeyBlock, count - block);
+            Luminance::Compute(reinterpret_cast<const unsigned char*>(pixels.data() + block), n, keys);
+            for (size_t k = 0; k < n; ++k) {
+                records[block + k] = {keys[k], static_cast<std::uint32_t>(block + k)};
             }
         }
+        PPMImage::RadixSort(records, threads);
+        for (auto& record : records) {
+            record.index = colorPayload ? PackColor(pixels[record.index]) : static_cast<std::uint32_t>(start + record.index);
+        }
+
+        runs.push_back(TempFile(tag));
+        RecordWriter<Record> writer(runs.back(), 0);
+        writer.Write(records.data(), records.size());
+        writer.Flush();
     }
-    input.close();
+    return runs;
 }
 
-void PPMImage::AllocateImage() {
-    imageData.resize(height, std::vector<RGB>(width, {255, 255, 255, 0, 0}));
+// Merges consecutive runs, fanIn at a time, until at most limit are left
+std::vector<fs::path> ExternalTransfer::ReduceRuns(std::vector<fs::path> runs, size_t limit, const std::string& tag) {
+    while (runs.size() > limit) {
+        std::vector<fs::path> merged;
+        for (size_t first = 0; first < runs.size(); first += fanIn) {
+            std::vector<fs::path> group(runs.begin() + first, runs.begin() + std::min(first + fanIn, runs.size()));
+            if (group.size() == 1) {
+                merged.push_back(group[0]);
+                continue;
+            }
+            size_t bufferRecords = std::max(kMinBufferRecords, options.memoryBudget / (group.size() + 1) / sizeof(Record));
+            merged.push_back(TempFile(tag));
+            {
+                RunMerger merger(group, bufferRecords);
+                RecordWriter<Record> writer(merged.back(), bufferRecords);
+                Record record{};
+                while (merger.Next(record)) writer.Push(record);
+                writer.Flush();
+            }
+            for (const auto& run : group) fs::remove(run);
+            ReleaseFreedMemory();
+        }
+        runs = std::move(merged);
+    }
+    return runs;
 }
 
-void PPMImage::Resize(int newHeight, int newWidth) {
-    std::vector<std::vector<RGB>> resized(newHeight, std::vector<RGB>(newWidth));
-    for (int i = 0; i < newHeight; ++i) {
-        for (int j = 0; j < newWidth; ++j) {
-            resized[i][j] = imageData[i * height / newHeight][j * width / newWidth];
+// Distributes a partition over at most fanIn children of whole strips
+std::vector<ExternalTransfer::Partition> ExternalTransfer::Split(const Partition& partition, size_t stripPixels) {
+    size_t strips = (partition.count + stripPixels - 1) / stripPixels;
+    size_t childPixels = (strips + fanIn - 1) / fanIn * stripPixels;
+    std::vector<Partition> children;
+    for (size_t first = 0; first < partition.count; first += childPixels) {
+        children.push_back({TempFile("strip"), partition.first + first, std::min(childPixels, partition.count - first)});
+    }
+    if (partition.file.empty()) return children; // nothing to redistribute yet
+
+    size_t bufferRecords = std::max(kMinBufferRecords, options.memoryBudget / (children.size() + 1) / sizeof(StripRecord));
+    {
+        RecordReader<StripRecord> reader(partition.file, bufferRecords);
+        std::vector<std::unique_ptr<RecordWriter<StripRecord>>> writers;
+        for (const auto& child : children) {
+            writers.push_back(std::make_unique<RecordWriter<StripRecord>>(child.file, bufferRecords));
+        }
+        StripRecord record{};
+        while (reader.Next(record)) {
+            writers[(record.index - partition.first) / childPixels]->Push(record);
+        }
+        for (auto& writer : writers) {
+            writer->Flush();
         }
     }
-    imageData = std::move(resized);
-    height = newHeight;
-    width = newWidth;
+    fs::remove(partition.file);
+    ReleaseFreedMemory();
+    return children;
 }
 
-void PPMImage::ComputeLuminanceAndSort() {
-    sortedPixels.clear();
-    for (int i = 0; i < height; ++i) {
-        for (int j = 0; j < width; ++j) {
-            auto& pixel = imageData[i][j];
-            pixel.luminance = 0.299f * pixel.r + 0.587f * pixel.g + 0.114f * pixel.b;
-            pixel.x = j;
-            pixel.y = i;
-            sortedPixels.push_back(pixel);
+// Splits groups until every partition is a single strip, keeping output order.
+// Done before the strip buffer exists, so splitting has the budget to itself.
+std::vector<ExternalTransfer::Partition> ExternalTransfer::SplitIntoStrips(const std::vector<Partition>& groups,
+                                                                           size_t stripPixels) {
+    std::vector<Partition> pending(groups.rbegin(), groups.rend());
+    std::vector<Partition> strips;
+    while (!pending.empty()) {
+        Partition partition = std::move(pending.back());
+        pending.pop_back();
+        if (partition.count <= stripPixels) {
+            strips.push_back(std::move(partition));
+            continue;
         }
+        std::vector<Partition> children = Split(partition, stripPixels);
+        pending.insert(pending.end(), std::make_move_iterator(children.rbegin()), std::make_move_iterator(children.rend()));
     }
-    std::stable_sort(sortedPixels.begin(), sortedPixels.end(), [](const RGB& a, const RGB& b) {
-        return a.luminance < b.luminance;
-    });
+    return strips;
 }
 
-void PPMImage::UpdatePixels(PPMImage* source, PPMImage* target) {
-    if (!source || !target) return;
+void ExternalTransfer::Run(const std::string& sourceFile, const std::string& targetFile, const std::string& outputFile) {
+#ifdef __GLIBC__
+    // A fixed threshold keeps every large buffer in its own mapping that goes back to
+    // the OS when freed. glibc would otherwise raise the threshold after the first such
+    // free and serve the next chunk's buffers from a heap that fragments past the budget.
+    mallopt(M_MMAP_THRESHOLD, 128 * 1024);
+#endif
+    fanIn = FanIn();
+    std::vector<fs::path> sourceRuns, targetRuns;
+    size_t sourcePixels = 0, targetPixels = 0;
+    int width = 0, height = 0;
+    {
+        Input source(sourceFile);
+        Input target(targetFile);
+        CheckAddressable(source, sourceFile);
+        CheckAddressable(target, targetFile);
+        {
+            RunReport::Stage stage("sorted runs", sourceFile, source.Pixels(), source.Pixels() * sizeof(RGB));
+            sourceRuns = WriteSortedRuns(source, true, "palette-run");
+            ReleaseFreedMemory();
+        }
+        {
+            RunReport::Stage stage("sorted runs", targetFile, target.Pixels(), target.Pixels() * sizeof(RGB));
+            targetRuns = WriteSortedRuns(target, false, "base-run");
+            ReleaseFreedMemory();
+        }
+        sourcePixels = source.Pixels();
+        targetPixels = target.Pixels();
+        width = target.Width();
+        height = target.Height();
+    }
+    if (sourceRuns.size() + targetRuns.size() > fanIn) {
+        RunReport::Stage stage("reduce runs", targetFile, targetPixels, (sourcePixels + targetPixels) * sizeof(Record));
+        sourceRuns = ReduceRuns(std::move(sourceRuns), fanIn / 2, "palette-run");
+        targetRuns = ReduceRuns(std::move(targetRuns), fanIn - fanIn / 2, "base-run");
+    }
+
+    // Output strips: 7/8 of the budget for the strip, the rest for reading its partition
+    int stripRows = static_cast<int>(std::clamp<size_t>(options.memoryBudget / 8 * 7 / sizeof(RGB) / width, 1, height));
+    size_t stripPixels = static_cast<size_t>(stripRows) * width;
+    std::vector<Partition> groups = Split({fs::path(), 0, targetPixels}, stripPixels);
+    size_t groupPixels = groups[0].count;
+
+    {
+        RunReport::Stage stage("merge runs", targetFile, targetPixels, (sourcePixels + targetPixels) * sizeof(Record));
+        size_t streams = sourceRuns.size() + targetRuns.size() + groups.size();
+        size_t bufferRecords = std::clamp(options.memoryBudget / streams / sizeof(Record), kMinBufferRecords,
+                                          std::max(kMinBufferRecords, stripPixels));
+        RunMerger palette(sourceRuns, bufferRecords);
+        RunMerger base(targetRuns, bufferRecords);
+        std::vector<std::unique_ptr<RecordWriter<StripRecord>>> writers;
+        for (const auto& group : groups) {
+            writers.push_back(std::make_unique<RecordWriter<StripRecord>>(group.file, bufferRecords));
+        }
+
+        Record paletteRecord{}, baseRecord{};
+        size_t paletteRank = 0;
+        bool havePalette = palette.Next(paletteRecord);
+        for (size_t rank = 0; base.Next(baseRecord); ++rank) {
+            size_t wanted = PPMImage::ScaleRank(rank, sourcePixels, targetPixels);
+            while (havePalette && paletteRank < wanted) {
+                havePalette = palette.Next(paletteRecord);
+                ++paletteRank;
+            }
+            writers[baseRecord.index / groupPixels]->Push({baseRecord.index, paletteRecord.index});
+        }
+        for (auto& writer : writers) {
+            writer->Flush();
+        }
+    }
+    for (const auto& run : sourceRuns) fs::remove(run);
+    for (const auto& run : targetRuns) fs::remove(run);
+    ReleaseFreedMemory();
+
+    std::vector<Partition> strips;
+    {
+        RunReport::Stage stage("split partitions", outputFile, targetPixels, targetPixels * sizeof(StripRecord));
+        strips = SplitIntoStrips(groups, stripPixels);
+    }
 
-    for (size_t i = 0; i < source->sortedPixels.size(); ++i) {
-        RGB& srcPixel = source->sortedPixels[i];
-        RGB& tgtPixel = target->sortedPixels[i];
-        
-        pixelMap[{tgtPixel.x, tgtPixel.y}] = {srcPixel.r, srcPixel.g, srcPixel.b};
+    RunReport::Stage stage("write strips", outputFile, targetPixels, targetPixels * sizeof(RGB));
+    PPMImage::StripWriter output(outputFile, width, height);
+    std::vector<RGB> strip(stripPixels);
+    size_t readerRecords = std::max(kMinBufferRecords, options.memoryBudget / 8 / sizeof(StripRecord));
+    for (const auto& partition : strips) {
+        {
+            RecordReader<StripRecord> reader(partition.file, readerRecords);
+            StripRecord record{};
+            while (reader.Next(record)) {
+                strip[record.index - partition.first] = UnpackColor(record.color);
+            }
+        }
+        fs::remove(partition.file);
+        output.Write(strip.data(), static_cast<int>(partition.count / width));
     }
+    output.Close();
 }
 
-void PPMImage::ApplyUpdatedPixels() {
-    for (int i = 0; i < height; ++i) {
-        for (int j = 0; j < width; ++j) {
-            if (pixelMap.count({j, i})) {
-                imageData[i][j] = pixelMap[{j, i}];
+// Decodes a JPEG (or anything CImg reads) and hands the pixels to PPMImage
+// directly, no temporary .ppm file. Throws when the file is missing or unreadable.
+void LoadImage(const fs::path& path, PPMImage& image) {
+    std::string name = path.filename().string();
+    if (!fs::exists(path)) {
+        throw std::runtime_error("File '" + path.string() + "' not found.");
+    }
+    CImg<unsigned char> decoded;
+    {
+        std::error_code ignored;
+        RunReport::Stage stage("decode", name);
+        decoded.load(path.string().c_str()); // Load the image
+        stage.SetWork(static_cast<std::uint64_t>(decoded.width()) * decoded.height(), fs::file_size(path, ignored));
+    }
+    printf("%s Loaded\n", name.c_str());
+    {
+        RunReport::Stage stage("import", name, static_cast<std::uint64_t>(decoded.width()) * decoded.height(),
+                               static_cast<std::uint64_t>(decoded.width()) * decoded.height() * 3);
+        image.Import(decoded);
+    }
+    printf("%s Converted\n", name.c_str());
+}
+
+// Stage working on a whole image: its pixels, with its payload as the bytes processed
+RunReport::Stage ImageStage(const char* name, const std::string& subject, const PPMImage& image) {
+    return RunReport::Stage(name, subject, image.GetPixelCount(), image.GetPixelCount() * sizeof(PPMImage::RGB));
+}
+
+// Stage writing a file; the bytes are the file's size once it is written
+template <typename F>
+void SaveStage(const char* name, const std::string& filename, const PPMImage& image, F&& save) {
+    RunReport::Stage stage(name, filename, image.GetPixelCount());
+    save();
+    std::error_code ignored;
+    std::uintmax_t size = fs::file_size(filename, ignored);
+    stage.SetWork(image.GetPixelCount(), size == static_cast<std::uintmax_t>(-1) ? 0 : size);
+}
+
+struct Options {
+    unsigned threads = 0; // 0 = pool default
+    bool help = false;
+    bool keepSize = false; // transfer by scaled rank instead of resizing the base image
+    bool histogram = false; // histogram/CDF transfer instead of sorting both images
+    int keyBits = PPMImage::kDefaultKeyBits;
+    bool batch = false;
+    bool buildPalette = false;
+    bool external = false;
+    fs::path basePath;
+    fs::path outputPath;
+    size_t memoryBudgetMB = 1024;
+    fs::path tempDir;
+    fs::path palettePath;
+    fs::path paletteIndex;
+    fs::path outputDir;
+    std::vector<fs::path> inputs;
+    fs::path reportPath; // per-stage timings as JSON, empty = none
+    fs::path tracePath; // Chrome trace of every stage and pool task, empty = none
+    bool perf = false; // hardware counters per stage
+    PPMImage::SaveMode saveMode = PPMImage::SaveMode::Auto; // how the default run writes its PPMs
+    PPMImage::SortMode sortMode = PPMImage::SortMode::Radix;
+    unsigned sortThreads = 0; // 0 = the whole pool
+};
+
+void PrintUsage(const char* program) {
+    std::cout << "Usage: " << program << " [--threads N] [--keep-size] [--mode sort|histogram] [--key-bits 8..16]\n"
+              << "         [--save-mode auto|stream|parallel|mapped]\n"
+              << "         Recolors obrazB.jpg with obrazA.jpg from the current directory into C.png\n"
+              << "       " << program << " [--threads N] [--keep-size] [--mode sort|histogram] [--key-bits 8..16] --batch <palette image> <output dir> <base image>...\n"
+              << "         Sorts the palette image once and writes <output dir>/<base name>.png per base image;\n"
+              << "         the palette may also be an index written by --build-palette\n"
+              << "       " << program << " [--threads N] [--mode sort|histogram] [--key-bits 8..16] --build-palette <palette image> <index file>\n"
+              << "         Saves the palette image's luminance-ranked colors for later --batch runs with the same\n"
+              << "         --mode and --key-bits\n"
+              << "       " << program << " [--threads N] [--memory-budget MB] [--temp-dir DIR] --external <palette.ppm> <base.ppm> <output.ppm>\n"
+              << "         Out-of-core recolor for images larger than memory; keeps the base resolution\n"
+              << "--keep-size keeps the base image at its own resolution: its i-th ranked pixel takes\n"
+              << "the palette's rank floor(i * palette pixels / base pixels) instead of resizing first\n"
+              << "--mode histogram ranks pixels by luminance buckets of --key-bits precision (default 16)\n"
+              << "instead of sorting; ties inside a bucket keep raster order\n"
+              << "--report <file> writes every stage's wall and CPU time, pixels, bytes, MP/s, operator new\n"
+              << "allocations and peak RSS delta as JSON\n"
+              << "--trace <file> writes a Chrome/Perfetto trace with a span per stage and pool task per thread\n"
+              << "--perf counts cycles, instructions, LLC, branch and dTLB misses per stage (Linux) and prints\n"
+              << "IPC and misses per pixel; with --report the counts go into the JSON too\n"
+              << "--save-mode auto|stream|parallel|mapped picks how ResultA.ppm and ResultB.ppm are written:\n"
+              << "one stream, parallel pwrite or a shared mapping; auto goes parallel from 64 MB\n"
+              << "--sort radix|comparison picks the luminance sort: LSD radix (default) or std::stable_sort;\n"
+              << "both produce the same order\n"
+              << "--sort-threads N caps the threads one image's sort or histogram bucketing splits into\n"
+              << "(default: the whole pool)\n";
+}
+
+// Throws std::runtime_error on malformed command lines
+Options ParseOptions(int argc, char* argv[]) {
+    Options options;
+    std::vector<std::string> args(argv + 1, argv + argc);
+    for (size_t i = 0; i < args.size(); ++i) {
+        const std::string& arg = args[i];
+        if (arg == "--help" || arg == "-h") {
+            options.help = true;
+        } else if (arg == "--mode") {
+            if (i + 1 >= args.size()) throw std::runtime_error("--mode needs 'sort' or 'histogram'");
+            const std::string& mode = args[++i];
+            if (mode != "sort" && mode != "histogram") throw std::runtime_error("Unknown mode '" + mode + "'");
+            options.histogram = mode == "histogram";
+        } else if (arg == "--key-bits") {
+            if (i + 1 >= args.size()) throw std::runtime_error("--key-bits needs a value");
+            options.keyBits = std::atoi(args[++i].c_str());
+            if (options.keyBits < 8 || options.keyBits > 16) throw std::runtime_error("--key-bits must be between 8 and 16");
+        } else if (arg == "--keep-size") {
+            options.keepSize = true;
+        } else if (arg == "--threads") {
+            if (i + 1 >= args.size()) throw std::runtime_error("--threads needs a value");
+            int threads = std::atoi(args[++i].c_str());
+            if (threads <= 0) throw std::runtime_error("--threads must be positive");
+            options.threads = static_cast<unsigned>(threads);
+        } else if (arg == "--batch") {
+            if (i + 3 >= args.size()) throw std::runtime_error("--batch needs a palette image, an output directory and at least one base image");
+            options.batch = true;
+            options.palettePath = args[++i];
+            options.outputDir = args[++i];
+            while (i + 1 < args.size() && args[i + 1].rfind("--", 0) != 0) {
+                options.inputs.emplace_back(args[++i]);
             }
+            if (options.inputs.empty()) throw std::runtime_error("--batch needs at least one base image");
+        } else if (arg == "--external") {
+            if (i + 3 >= args.size()) throw std::runtime_error("--external needs a palette PPM, a base PPM and an output PPM");
+            options.external = true;
+            options.palettePath = args[++i];
+            options.basePath = args[++i];
+            options.outputPath = args[++i];
+        } else if (arg == "--memory-budget") {
+            if (i + 1 >= args.size()) throw std::runtime_error("--memory-budget needs a size in MB");
+            long long megabytes = std::atoll(args[++i].c_str());
+            if (megabytes <= 0) throw std::runtime_error("--memory-budget must be positive");
+            options.memoryBudgetMB = static_cast<size_t>(megabytes);
+        } else if (arg == "--temp-dir") {
+            if (i + 1 >= args.size()) throw std::runtime_error("--temp-dir needs a directory");
+            options.tempDir = args[++i];
+        } else if (arg == "--report") {
+            if (i + 1 >= args.size()) throw std::runtime_error("--report needs a file");
+            options.reportPath = args[++i];
+        } else if (arg == "--perf") {
+            options.perf = true;
+        } else if (arg == "--save-mode") {
+            if (i + 1 >= args.size()) throw std::runtime_error("--save-mode needs 'auto', 'stream', 'parallel' or 'mapped'");
+            const std::string& mode = args[++i];
+            if (mode == "auto") {
+                options.saveMode = PPMImage::SaveMode::Auto;
+            } else if (mode == "stream") {
+                options.saveMode = PPMImage::SaveMode::Stream;
+            } else if (mode == "parallel") {
+                options.saveMode = PPMImage::SaveMode::Parallel;
+            } else if (mode == "mapped") {
+                options.saveMode = PPMImage::SaveMode::Mapped;
+            } else {
+                throw std::runtime_error("Unknown save mode '" + mode + "'");
+            }
+        } else if (arg == "--sort") {
+            if (i + 1 >= args.size()) throw std::runtime_error("--sort needs 'radix' or 'comparison'");
+            const std::string& sort = args[++i];
+            if (sort != "radix" && sort != "comparison") throw std::runtime_error("Unknown sort '" + sort + "'");
+            options.sortMode = sort == "radix" ? PPMImage::SortMode::Radix : PPMImage::SortMode::Comparison;
+        } else if (arg == "--sort-threads") {
+            if (i + 1 >= args.size()) throw std::runtime_error("--sort-threads needs a value");
+            int threads = std::atoi(args[++i].c_str());
+            if (threads <= 0) throw std::runtime_error("--sort-threads must be positive");
+            options.sortThreads = static_cast<unsigned>(threads);
+        } else if (arg == "--trace") {
+            if (i + 1 >= args.size()) throw std::runtime_error("--trace needs a file");
+            options.tracePath = args[++i];
+        } else if (arg == "--build-palette") {
+            if (i + 2 >= args.size()) throw std::runtime_error("--build-palette needs a palette image and an index file");
+            options.buildPalette = true;
+            options.palettePath = args[++i];
+            options.paletteIndex = args[++i];
+        } else {
+            throw std::runtime_error("Unknown argument '" + arg + "'");
         }
     }
+    return options;
 }
 
-void PPMImage::CountUniqueColors() {
-    std::set<std::tuple<unsigned char, unsigned char, unsigned char>> uniqueColors;
-    for (const auto& row : imageData) {
-        for (const auto& pixel : row) {
-            uniqueColors.insert({pixel.r, pixel.g, pixel.b});
+// Settings every image that gets loaded and ranked takes from the command line
+void ConfigureImage(PPMImage& image, const Options& options) {
+    image.SetIngestKeys(!options.histogram);
+    image.SetSortMode(options.sortMode);
+    image.SetSortThreads(options.sortThreads);
+}
+
+// Describes a palette's ranking the way it is asked for on the command line
+std::string RankingName(int keyBits) {
+    return keyBits ? "--mode histogram --key-bits " + std::to_string(keyBits) : "--mode sort";
+}
+
+// Opens a palette index file as is, or decodes and ranks a palette image. An
+// index must have been ranked the way this run ranks its base images, else the
+// transfer would pair ranks that don't correspond.
+PPMImage::Palette LoadPalette(const fs::path& path, const Options& options) {
+    if (PPMImage::Palette::IsIndexFile(path.string())) {
+        PPMImage::Palette palette = PPMImage::Palette::Load(path.string());
+        int wanted = options.histogram ? options.keyBits : 0;
+        if (palette.keyBits != wanted) {
+            throw std::runtime_error("Palette index '" + path.string() + "' was built with " +
+                                     RankingName(palette.keyBits) + " but this run uses " + RankingName(wanted) +
+                                     "; rerun with the same options or rebuild the index");
+        }
+        return palette;
+    }
+    PPMImage source;
+    ConfigureImage(source, options);
+    LoadImage(path, source);
+    std::string name = path.filename().string();
+    {
+        auto stage = ImageStage("count unique colors", name, source);
+        source.CountUniqueColors();
+    }
+    if (options.histogram) {
+        auto stage = ImageStage("bucket palette", name, source);
+        return source.ExtractBucketedPalette(options.keyBits);
+    }
+    {
+        auto stage = ImageStage("sort", name, source);
+        source.ComputeLuminanceAndSort();
+    }
+    auto stage = ImageStage("extract palette", name, source);
+    return source.ExtractPalette();
+}
+
+int RunExternal(const Options& options) {
+    auto start = std::chrono::high_resolution_clock::now();
+    try {
+        ExternalTransfer transfer({options.memoryBudgetMB << 20, options.tempDir});
+        transfer.Run(options.palettePath.string(), options.basePath.string(), options.outputPath.string());
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    std::cout << "Saved " << options.outputPath << " in "
+              << std::chrono::duration<float, std::milli>(end - start).count() << " ms" << std::endl;
+    return 0;
+}
+
+int RunBuildPalette(const Options& options) {
+    try {
+        PPMImage::Palette palette = LoadPalette(options.palettePath, options);
+        RunReport::Stage stage("save palette index", options.paletteIndex.string(), palette.Colors().size(),
+                               palette.Colors().size() * sizeof(PPMImage::RGB));
+        palette.Save(options.paletteIndex.string());
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    std::cout << "Palette index saved as " << options.paletteIndex << std::endl;
+    return 0;
+}
+
+// Sorts the palette image once and keeps only its ranked colors, then streams
+// every base image through sort, transfer and PNG encode against them. The next
+// base image is decoded while the current one is being processed.
+int RunBatch(const Options& options) {
+    auto start = std::chrono::high_resolution_clock::now();
+    ThreadPool& pool = ThreadPool::Instance();
+
+    // Before the palette is decoded and sorted, so a bad output path fails fast
+    std::error_code error;
+    fs::create_directories(options.outputDir, error);
+    if (error || !fs::is_directory(options.outputDir, error)) {
+        std::cerr << "Error: cannot use " << options.outputDir << " as the output directory"
+                  << (error ? ": " + error.message() : std::string()) << std::endl;
+        return 1;
+    }
+
+    PPMImage::Palette palette;
+    try {
+        palette = LoadPalette(options.palettePath, options);
+    } catch (const std::exception& e) {
+        std::cerr << "Error loading palette " << options.palettePath << ": " << e.what() << std::endl;
+        return 1;
+    }
+
+    auto load = [&](size_t i) {
+        return pool.Submit([&options, i]() {
+            auto image = std::make_unique<PPMImage>();
+            ConfigureImage(*image, options);
+            LoadImage(options.inputs[i], *image);
+            return image;
+        });
+    };
+
+    size_t total = options.inputs.size();
+    int failures = 0;
+    auto next = load(0);
+    for (size_t i = 0; i < total; ++i) {
+        auto current = std::move(next);
+        if (i + 1 < total) next = load(i + 1);
+
+        const fs::path& input = options.inputs[i];
+        fs::path output = options.outputDir / (input.stem().string() + ".png");
+        try {
+            std::unique_ptr<PPMImage> image = pool.Wait(current);
+            std::string name = input.filename().string();
+            if (!options.keepSize && (image->GetHeight() != palette.height || image->GetWidth() != palette.width)) {
+                RunReport::Stage stage("resize", name, std::uint64_t(palette.width) * palette.height,
+                                       std::uint64_t(palette.width) * palette.height * sizeof(PPMImage::RGB));
+                image->Resize(palette.height, palette.width);
+            }
+            if (options.histogram) {
+                auto stage = ImageStage("histogram transfer", name, *image);
+                image->TransferByHistogram(palette, options.keyBits);
+            } else {
+                {
+                    auto stage = ImageStage("sort", name, *image);
+                    image->ComputeLuminanceAndSort();
+                }
+                {
+                    auto stage = ImageStage("update pixels", name, *image);
+                    image->UpdatePixels(palette);
+                }
+                auto stage = ImageStage("apply updated pixels", name, *image);
+                image->ApplyUpdatedPixels();
+            }
+            SaveStage("encode png", output.string(), *image, [&]() { image->SavePNG(output.string()); });
+        } catch (const std::exception& e) {
+            std::cerr << "Error processing " << input << ": " << e.what() << std::endl;
+            ++failures;
         }
+        ShowProgressBar("Batch", static_cast<int>(i + 1), static_cast<int>(total));
     }
-    std::cout << "Unique colors: " << uniqueColors.size() << std::endl;
+
+    auto end = std::chrono::high_resolution_clock::now();
+    std::cout << "Batch: " << total - failures << "/" << total << " images in "
+              << std::chrono::duration<float, std::milli>(end - start).count() << " ms" << std::endl;
+    return failures ? 1 : 0;
 }
 
-int main() {
+// The default run: recolors obrazB.jpg with obrazA.jpg from the current directory
+int RunRecolor(const Options& options) {
     auto start = std::chrono::high_resolution_clock::now();
     
     printf("====== IMAGE PAINTER 0.1 ======\n");
@@ -187,80 +2892,98 @@ int main() {
     // Progress bar for loading images
     ShowProgressBar("Loading Images", 0, 3);
 
-    try {
-        if (!fs::exists(imagePathA)) {
-            throw std::runtime_error("File 'obrazA.jpg' not found in the current directory.");
-        }
-        CImg<unsigned char> imA(imagePathA.string().c_str()); // Load the image
-        printf("obrazA Loaded\n");
-        // Save as PPMImage
-        imA.save("A.ppm");
-        printf("obrazA Saved as A.ppm\n");
-        ShowProgressBar("Loading Images", 1, 3);
-    } catch (const CImgIOException& e) {
-        std::cerr << "Error loading obrazA: " << e.what() << std::endl;
-        return 1;
-    } catch (const std::exception& e) {
-        std::cerr << "Error: " << e.what() << std::endl;
-        return 1;
-    }
-    
-    try {
-        if (!fs::exists(imagePathB)) {
-            throw std::runtime_error("File 'obrazB.jpg' not found in the current directory.");
-        }
-        CImg<unsigned char> imB(imagePathB.string().c_str()); // Load the image
-        printf("obrazB Loaded\n");
-        // Save as PPMImage
-        imB.save("B.ppm");
-        printf("obrazB Saved as B.ppm\n");
-        ShowProgressBar("Loading Images", 2, 3);
-    } catch (const CImgIOException& e) {
-        std::cerr << "Error loading obrazB: " << e.what() << std::endl;
-        return 1;
-    } catch (const std::exception& e) {
-        std::cerr << "Error: " << e.what() << std::endl;
-        return 1;
+    // Decode both inputs at the same time; each task reports its own failure
+    ThreadPool& pool = ThreadPool::Instance();
+    PPMImage imgA, imgB;
+    ConfigureImage(imgA, options);
+    ConfigureImage(imgB, options);
+    imgA.SetSaveMode(options.saveMode);
+    imgB.SetSaveMode(options.saveMode);
+    auto loadA = pool.Submit([&]() { LoadImage(imagePathA, imgA); });
+    auto loadB = pool.Submit([&]() { LoadImage(imagePathB, imgB); });
+
+    bool loadFailed = false;
+    int loaded = 0;
+    for (auto* task : {&loadA, &loadB}) {
+        const char* name = task == &loadA ? "obrazA" : "obrazB";
+        try {
+            pool.Wait(*task);
+            ShowProgressBar("Loading Images", ++loaded, 3);
+        } catch (const CImgIOException& e) {
+            std::cerr << "Error loading " << name << ": " << e.what() << std::endl;
+            loadFailed = true;
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            loadFailed = true;
+        }
     }
+    if (loadFailed) return 1;
 
     ShowProgressBar("Loading Images", 3, 3);
 
-    PPMImage imgA, imgB;
-    imgA.Read("A.ppm");
-    imgB.Read("B.ppm");
-
-    if (imgA.GetHeight() != imgB.GetHeight() || imgA.GetWidth() != imgB.GetWidth()) {
+    std::string nameA = imagePathA.filename().string(), nameB = imagePathB.filename().string();
+    if (!options.keepSize && (imgA.GetHeight() != imgB.GetHeight() || imgA.GetWidth() != imgB.GetWidth())) {
+        RunReport::Stage stage("resize", nameB, imgA.GetPixelCount(), imgA.GetPixelCount() * sizeof(PPMImage::RGB));
         imgB.Resize(imgA.GetHeight(), imgA.GetWidth());
     }
 
     // Progress bar for processing images
     ShowProgressBar("Processing Images", 0, 4);
 
-    auto task1 = std::async(std::launch::async, &PPMImage::ComputeLuminanceAndSort, &imgA);
-    auto task2 = std::async(std::launch::async, &PPMImage::ComputeLuminanceAndSort, &imgB);
-    task1.get();
+    // Histogram mode only needs A's bucketed colors; B is bucketed during the transfer
+    PPMImage::Palette bucketedA;
+    auto task1 = pool.Submit([&]() {
+        if (options.histogram) {
+            auto stage = ImageStage("bucket palette", nameA, imgA);
+            bucketedA = imgA.ExtractBucketedPalette(options.keyBits);
+        } else {
+            auto stage = ImageStage("sort", nameA, imgA);
+            imgA.ComputeLuminanceAndSort();
+        }
+    });
+    auto task2 = pool.Submit([&]() {
+        if (options.histogram) return;
+        auto stage = ImageStage("sort", nameB, imgB);
+        imgB.ComputeLuminanceAndSort();
+    });
+    pool.Wait(task1);
     ShowProgressBar("Processing Images", 1, 4);
-    task2.get();
+    pool.Wait(task2);
     ShowProgressBar("Processing Images", 2, 4);
 
-    auto task3 = std::async(std::launch::async, &PPMImage::CountUniqueColors, &imgA);
-    auto task4 = std::async(std::launch::async, &PPMImage::CountUniqueColors, &imgB);
-    task3.get();
+    auto task3 = pool.Submit([&]() {
+        auto stage = ImageStage("count unique colors", nameA, imgA);
+        imgA.CountUniqueColors();
+    });
+    auto task4 = pool.Submit([&]() {
+        auto stage = ImageStage("count unique colors", nameB, imgB);
+        imgB.CountUniqueColors();
+    });
+    pool.Wait(task3);
     ShowProgressBar("Processing Images", 3, 4);
-    task4.get();
+    pool.Wait(task4);
     ShowProgressBar("Processing Images", 4, 4);
 
-    imgB.UpdatePixels(&imgA, &imgB);
-    imgB.ApplyUpdatedPixels();
-
-    imgA.Save("ResultA.ppm");
-    imgB.Save("ResultB.ppm");
+    if (options.histogram) {
+        auto stage = ImageStage("histogram transfer", nameB, imgB);
+        imgB.TransferByHistogram(bucketedA, options.keyBits);
+    } else {
+        {
+            auto stage = ImageStage("update pixels", nameB, imgB);
+            imgB.UpdatePixels(&imgA, &imgB);
+        }
+        auto stage = ImageStage("apply updated pixels", nameB, imgB);
+        imgB.ApplyUpdatedPixels();
+    }
 
-    
-    // Load PPMImage image
-    CImg<unsigned char> PPMImageb("ResultB.ppm");
-    // Save as 
-    PPMImageb.save("C.png");
+    // The outputs are independent, so write them side by side
+    auto saveA = pool.Submit([&imgA]() { SaveStage("save ppm", "ResultA.ppm", imgA, [&]() { imgA.Save("ResultA.ppm"); }); });
+    auto saveB = pool.Submit([&imgB]() { SaveStage("save ppm", "ResultB.ppm", imgB, [&]() { imgB.Save("ResultB.ppm"); }); });
+    // Encode straight from imageData instead of reloading ResultB.ppm
+    auto savePNG = pool.Submit([&imgB]() { SaveStage("encode png", "C.png", imgB, [&]() { imgB.SavePNG("C.png"); }); });
+    pool.Wait(saveA);
+    pool.Wait(saveB);
+    pool.Wait(savePNG);
     printf("====== C.png Saved ======\n");
     //========================================================
 
@@ -270,4 +2993,48 @@ int main() {
 
 
     return 0;
-}
\ No newline at end of file
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    try {
+        options = ParseOptions(argc, argv);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        PrintUsage(argv[0]);
+        return 2;
+    }
+    if (options.help) {
+        PrintUsage(argv[0]);
+        return 0;
+    }
+    if (options.threads) ThreadPool::Configure(options.threads);
+    // Before the pool exists, so its workers inherit the counters
+    if (options.perf) {
+        std::string error;
+        if (PerfCounters::Instance().Open(error)) {
+            RunReport::Instance().Enable();
+        } else {
+            std::cerr << "Warning: hardware counters unavailable (" << error << ")" << std::endl;
+        }
+    }
+    if (!options.reportPath.empty()) RunReport::Instance().Enable();
+    if (!options.tracePath.empty()) {
+        TraceLog::Instance().Enable();
+        TraceLog::Instance().NameThread("main");
+    }
+
+    int status = options.external       ? RunExternal(options)
+                 : options.buildPalette ? RunBuildPalette(options)
+                 : options.batch        ? RunBatch(options)
+                                        : RunRecolor(options);
+    if (PerfCounters::Instance().Enabled()) RunReport::Instance().PrintCounters(std::cout);
+    try {
+        if (!options.reportPath.empty()) RunReport::Instance().Write(options.reportPath.string());
+        if (!options.tracePath.empty()) TraceLog::Instance().Write(options.tracePath.string());
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return status ? status : 1;
+    }
+    return status;
+}